@@ -0,0 +1,537 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "acceleration.h"
+#include <typeinfo>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#ifdef _WIN32
+//Keep std::min and std::max usable.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+/**
+ * @brief Subtrees with more primitives than this are built by a separate task.
+ */
+static constexpr size_t parallel_build_threshold = 4096;
+/**
+ * @brief Below this depth, nodes are split at the median to bound tree depth (and traversal stack size).
+ */
+static constexpr size_t max_sah_depth = 48;
+/**
+ * @brief Entries of the traversal stacks. Traversal adds at most one entry per level, so trees must be less deep.
+ */
+static constexpr size_t max_stack_size = 128;
+
+static inline float component(const Vec3<float>& v, int axis){
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static inline Vec3<float> min3(const Vec3<float>& a, const Vec3<float>& b){
+    return {std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)};
+}
+
+static inline Vec3<float> max3(const Vec3<float>& a, const Vec3<float>& b){
+    return {std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)};
+}
+
+static inline float surface_area(const Vec3<float>& min, const Vec3<float>& max){
+    Vec3<float> d = max - min;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/**
+ * @brief Shared state of a BVH build.
+ */
+struct BVHBuilder {
+    std::vector<Vec3<float>>    mins, maxs, centers;
+    std::vector<uint32_t>       indices;
+    std::vector<BVHNode>&       nodes;
+    std::atomic<uint32_t>       node_count {1};
+    task_group                  group;
+
+    BVHBuilder(std::vector<BVHNode>& _nodes) : nodes{_nodes} {}
+
+    /**
+     * @brief Build subtree of node from primitives in indices[begin, end).
+     */
+    void build(uint32_t node_index, uint32_t begin, uint32_t end, size_t depth){
+        BVHNode& node = nodes[node_index];
+        Vec3<float> min = {INFINITY, INFINITY, INFINITY}, max = {-INFINITY, -INFINITY, -INFINITY};
+        Vec3<float> cmin = min, cmax = max;
+        for(uint32_t i = begin; i < end; i++){
+            uint32_t p = indices[i];
+            min = min3(min, mins[p]);
+            max = max3(max, maxs[p]);
+            cmin = min3(cmin, centers[p]);
+            cmax = max3(cmax, centers[p]);
+        }
+        node.min = min;
+        node.max = max;
+
+        const uint32_t count = end - begin;
+        if(count <= BVH::max_leaf_size){
+            node.first = begin;
+            node.count = count;
+            return;
+        }
+
+        //Find cheapest split over all axes using binned SAH.
+        float best_cost = INFINITY;
+        int best_axis = -1;
+        size_t best_bin = 0;
+        for(int axis = 0; axis < 3 && depth < max_sah_depth; axis++){
+            float lo = component(cmin, axis), extent = component(cmax, axis) - lo;
+            if(extent <= 0) continue;
+            float scale = BVH::bin_count / extent;
+
+            size_t bin_counts[BVH::bin_count] = {};
+            Vec3<float> bin_min[BVH::bin_count], bin_max[BVH::bin_count];
+            for(size_t b = 0; b < BVH::bin_count; b++){
+                bin_min[b] = {INFINITY, INFINITY, INFINITY};
+                bin_max[b] = {-INFINITY, -INFINITY, -INFINITY};
+            }
+            for(uint32_t i = begin; i < end; i++){
+                uint32_t p = indices[i];
+                size_t b = std::min((size_t)((component(centers[p], axis) - lo) * scale), BVH::bin_count - 1);
+                bin_counts[b]++;
+                bin_min[b] = min3(bin_min[b], mins[p]);
+                bin_max[b] = max3(bin_max[b], maxs[p]);
+            }
+
+            //Sweep from the right to get areas of all right sides, then from the left evaluating costs.
+            float right_area[BVH::bin_count];
+            size_t right_count[BVH::bin_count];
+            Vec3<float> rmin = {INFINITY, INFINITY, INFINITY}, rmax = {-INFINITY, -INFINITY, -INFINITY};
+            size_t rcount = 0;
+            for(size_t b = BVH::bin_count - 1; b > 0; b--){
+                rmin = min3(rmin, bin_min[b]);
+                rmax = max3(rmax, bin_max[b]);
+                rcount += bin_counts[b];
+                right_area[b] = rcount ? surface_area(rmin, rmax) : 0;
+                right_count[b] = rcount;
+            }
+            Vec3<float> lmin = {INFINITY, INFINITY, INFINITY}, lmax = {-INFINITY, -INFINITY, -INFINITY};
+            size_t lcount = 0;
+            for(size_t b = 0; b < BVH::bin_count - 1; b++){
+                lmin = min3(lmin, bin_min[b]);
+                lmax = max3(lmax, bin_max[b]);
+                lcount += bin_counts[b];
+                if(lcount == 0 || right_count[b + 1] == 0) continue;
+                float cost = lcount * surface_area(lmin, lmax) + right_count[b + 1] * right_area[b + 1];
+                if(cost < best_cost){
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        //Cost of splitting relative to cost of a leaf (traversal step = 1, intersection test = 1).
+        float area = surface_area(min, max);
+        float split_cost = area > 0 ? 1 + best_cost / area : INFINITY;
+        if(best_axis < 0 ? count <= 4 * BVH::max_leaf_size : (split_cost >= count && count <= 4 * BVH::max_leaf_size)){
+            node.first = begin;
+            node.count = count;
+            return;
+        }
+
+        uint32_t mid;
+        if(best_axis >= 0){
+            float lo = component(cmin, best_axis);
+            float scale = BVH::bin_count / (component(cmax, best_axis) - lo);
+            auto split = std::partition(indices.begin() + begin, indices.begin() + end, [&](uint32_t p){
+                return std::min((size_t)((component(centers[p], best_axis) - lo) * scale), BVH::bin_count - 1) <= best_bin;
+            });
+            mid = (uint32_t)(split - indices.begin());
+        } else mid = begin;
+        if(mid == begin || mid == end){
+            //No usable SAH split (equal centers or tree too deep): split at the median of the widest axis.
+            Vec3<float> extent = cmax - cmin;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            mid = begin + count / 2;
+            std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end, [&](uint32_t a, uint32_t b){
+                return component(centers[a], axis) < component(centers[b], axis);
+            });
+        }
+
+        uint32_t left = node_count.fetch_add(2);
+        node.first = left;
+        node.count = 0;
+
+        if(count > parallel_build_threshold){
+            group.run([this, left, begin, mid, depth](){ build(left, begin, mid, depth + 1); });
+        } else build(left, begin, mid, depth + 1);
+        build(left + 1, mid, end, depth + 1);
+    }
+};
+
+BVH::BVH(const std::vector<Renderable*>& objects, const char* cache_path){
+    std::vector<Renderable*> bounded;
+    std::vector<BoundingBox> boxes;
+    bounded.reserve(objects.size());
+    boxes.reserve(objects.size());
+    for(Renderable* object : objects){
+        BoundingBox box = object->bounds();
+        if(box.is_finite()){
+            bounded.push_back(object);
+            boxes.push_back(box);
+        } else m_unbounded.push_back(object);
+    }
+    if(bounded.empty()) return;
+    if(bounded.size() > 0x7FFFFFFF) throw "Too many objects for BVH.";
+
+    if(!cache_path){
+        build(bounded, boxes);
+        return;
+    }
+
+    //Content hash of everything the BVH depends on: kind and bounds of objects, centers and radii of spheres.
+    ContentHash hash;
+    hash.add((uint64_t)bounded.size());
+    for(size_t i = 0; i < bounded.size(); i++){
+        const BoundingBox& box = boxes[i];
+        hash.add(box.a.x); hash.add(box.a.y); hash.add(box.a.z);
+        hash.add(box.b.x); hash.add(box.b.y); hash.add(box.b.z);
+        if(typeid(*bounded[i]) == typeid(Sphere)){
+            const Sphere* sphere = static_cast<const Sphere*>(bounded[i]);
+            hash.add(sphere->pos.x); hash.add(sphere->pos.y); hash.add(sphere->pos.z); hash.add(sphere->radius);
+        } else hash.add((uint32_t)0xFFFFFFFF);
+    }
+    if(load(cache_path, hash.value(), bounded)) return;
+    build(bounded, boxes);
+    save(cache_path, hash.value());
+}
+
+void BVH::build(const std::vector<Renderable*>& bounded, const std::vector<BoundingBox>& boxes){
+    m_node_storage.resize(2 * bounded.size() - 1);
+    BVHBuilder builder(m_node_storage);
+    const size_t count = bounded.size();
+    builder.mins.resize(count);
+    builder.maxs.resize(count);
+    builder.centers.resize(count);
+    builder.indices.resize(count);
+    for(size_t i = 0; i < count; i++){
+        builder.mins[i] = boxes[i].b;
+        builder.maxs[i] = boxes[i].a;
+        builder.centers[i] = (boxes[i].a + boxes[i].b) * 0.5f;
+        builder.indices[i] = (uint32_t)i;
+    }
+    builder.build(0, 0, (uint32_t)count, 0);
+    builder.group.wait();
+    m_node_storage.resize(builder.node_count.load());
+    m_nodes = m_node_storage.data();
+    m_node_count = m_node_storage.size();
+
+    m_primitives.resize(count);
+    m_spheres.resize(count);
+    for(size_t i = 0; i < count; i++){
+        Renderable* object = bounded[builder.indices[i]];
+        m_primitives[i] = object;
+        //Only exact spheres: derived types may override intersect().
+        if(typeid(*object) == typeid(Sphere)){
+            const Sphere* sphere = static_cast<const Sphere*>(object);
+            m_spheres.set(i, sphere->pos, sphere->radius);
+        } else m_has_generic = true;
+    }
+    m_index_storage = std::move(builder.indices);
+    m_indices = m_index_storage.data();
+    count_subtrees();
+}
+
+void BVH::count_subtrees(){
+    //Children are always stored behind their parent.
+    m_subtree_sizes.resize(m_node_count);
+    for(size_t i = m_node_count; i-- > 0;){
+        const BVHNode& node = m_nodes[i];
+        m_subtree_sizes[i] = node.is_leaf() ? node.count : m_subtree_sizes[node.first] + m_subtree_sizes[node.first + 1];
+    }
+}
+
+size_t BVH::cull(const Frustum& frustum, std::vector<uint8_t>& culled) const {
+    culled.assign(m_node_count, 0);
+    size_t count = 0;
+    uint32_t stack[max_stack_size];
+    size_t size = 0;
+    if(m_node_count) stack[size++] = 0;
+    while(size){
+        uint32_t index = stack[--size];
+        const BVHNode& node = m_nodes[index];
+        int location = frustum.classify(node.min, node.max);
+        if(location < 0){
+            culled[index] = 1;
+            count += m_subtree_sizes[index];
+        } else if(location == 0 && !node.is_leaf()){
+            stack[size++] = node.first;
+            stack[size++] = node.first + 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Header of a BVH cache file. Followed by nodes, primitive indices and sphere data (SphereSoA::data()),
+ * each starting at a multiple of 64 bytes. Data is stored in native byte order.
+ */
+struct BVHCacheHeader {
+    char        magic[8];
+    uint32_t    version;
+    /**
+     * @brief sizeof(BVHCacheHeader) and sizeof(BVHNode). Rejects files of platforms with other layouts.
+     */
+    uint32_t    header_size, node_size;
+    uint32_t    has_generic;
+    uint64_t    hash;
+    uint64_t    primitive_count, node_count;
+    uint64_t    nodes_offset, indices_offset, spheres_offset, file_size;
+};
+
+static const char cache_magic[8] = {'R', 'T', 'B', 'V', 'H', 'C', 0, 0};
+
+static inline uint64_t align64(uint64_t offset){
+    return (offset + 63) & ~(uint64_t)63;
+}
+
+bool BVH::load(const char* path, uint64_t hash, const std::vector<Renderable*>& bounded){
+    auto file = std::make_shared<MappedFile>();
+    if(!file->open(path) || file->size() < sizeof(BVHCacheHeader)) return false;
+    BVHCacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    const uint64_t count = bounded.size();
+    if(std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version
+        || header.header_size != sizeof(BVHCacheHeader) || header.node_size != sizeof(BVHNode)
+        || header.hash != hash || header.primitive_count != count || header.file_size != file->size()
+        || header.node_count == 0 || header.node_count > 2 * count - 1
+        || header.nodes_offset % 64 || header.indices_offset % 64 || header.spheres_offset % 64
+        || header.nodes_offset < sizeof(BVHCacheHeader)
+        || header.nodes_offset + header.node_count * sizeof(BVHNode) > header.indices_offset
+        || header.indices_offset + count * sizeof(uint32_t) > header.spheres_offset
+        || header.spheres_offset + SphereSoA::data_size(count) * sizeof(float) > header.file_size)
+        return false;
+
+    //Validate references, so a broken file cannot make traversal read out of bounds or loop. Children are always
+    //stored behind their parent, so depths can be calculated in node order.
+    const BVHNode* nodes = reinterpret_cast<const BVHNode*>(file->data() + header.nodes_offset);
+    const uint32_t* indices = reinterpret_cast<const uint32_t*>(file->data() + header.indices_offset);
+    std::vector<uint8_t> depths(header.node_count, 0);
+    for(uint64_t i = 0; i < header.node_count; i++){
+        const BVHNode& node = nodes[i];
+        if(node.is_leaf()){
+            if(node.count > 4 * max_leaf_size || (uint64_t)node.first + node.count > count) return false;
+            continue;
+        }
+        if(node.first <= i || (uint64_t)node.first + 1 >= header.node_count) return false;
+        uint8_t depth = depths[i] + 1;
+        if(depth >= max_stack_size - 1) return false;
+        depths[node.first] = std::max(depths[node.first], depth);
+        depths[node.first + 1] = std::max(depths[node.first + 1], depth);
+    }
+    std::vector<Renderable*> primitives(count);
+    bool has_generic = false;
+    for(uint64_t i = 0; i < count; i++){
+        if(indices[i] >= count) return false;
+        primitives[i] = bounded[indices[i]];
+        if(typeid(*primitives[i]) != typeid(Sphere)) has_generic = true;
+    }
+    if(has_generic != (header.has_generic != 0)) return false;
+
+    m_nodes = nodes;
+    m_node_count = header.node_count;
+    m_indices = indices;
+    m_spheres.view(reinterpret_cast<const float*>(file->data() + header.spheres_offset), count);
+    m_primitives = std::move(primitives);
+    m_has_generic = has_generic;
+    m_mapping = std::move(file);
+    count_subtrees();
+    return true;
+}
+
+void BVH::save(const char* path, uint64_t hash) const {
+    const uint64_t count = m_primitives.size();
+    BVHCacheHeader header = {};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.header_size = sizeof(BVHCacheHeader);
+    header.node_size = sizeof(BVHNode);
+    header.has_generic = m_has_generic;
+    header.hash = hash;
+    header.primitive_count = count;
+    header.node_count = m_node_count;
+    header.nodes_offset = align64(sizeof(BVHCacheHeader));
+    header.indices_offset = align64(header.nodes_offset + m_node_count * sizeof(BVHNode));
+    header.spheres_offset = align64(header.indices_offset + count * sizeof(uint32_t));
+    header.file_size = header.spheres_offset + SphereSoA::data_size(count) * sizeof(float);
+
+    //Write to temporary file first, so readers never see a partially written cache.
+    std::string temp_path = std::string(path) + ".tmp";
+    FILE* file = std::fopen(temp_path.c_str(), "wb");
+    if(!file){
+        std::cerr << "Cannot write BVH cache file '" << path << "'." << std::endl;
+        return;
+    }
+    static const char zeros[64] = {};
+    uint64_t position = 0;
+    auto write = [&](const void* data, uint64_t offset, uint64_t size){
+        bool ok = std::fwrite(zeros, 1, offset - position, file) == offset - position
+               && std::fwrite(data, 1, size, file) == size;
+        position = offset + size;
+        return ok;
+    };
+    bool ok = write(&header, 0, sizeof(header))
+           && write(m_nodes, header.nodes_offset, m_node_count * sizeof(BVHNode))
+           && write(m_indices, header.indices_offset, count * sizeof(uint32_t))
+           && write(m_spheres.data(), header.spheres_offset, SphereSoA::data_size(count) * sizeof(float));
+    ok = std::fclose(file) == 0 && ok;
+    //Replace an existing file in one step, so readers see either the old or the new cache.
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp_path.c_str(), path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && std::rename(temp_path.c_str(), path) == 0;
+#endif
+    if(!ok){
+        std::remove(temp_path.c_str());
+        std::cerr << "Cannot write BVH cache file '" << path << "'." << std::endl;
+    }
+}
+
+/**
+ * @brief Slab test of ray against node bounds.
+ * @return true if the box is hit in front of the ray and before t_max. t_near is set to the entry distance.
+ */
+static inline bool hit_box(const BVHNode& node, const Vec3<float>& start, const Vec3<float>& inv_dir, float t_max, float& t_near){
+    float t0 = (node.min.x - start.x) * inv_dir.x, t1 = (node.max.x - start.x) * inv_dir.x;
+    float near = std::max(0.0f, std::min(t0, t1)), far = std::min(t_max, std::max(t0, t1));
+    t0 = (node.min.y - start.y) * inv_dir.y; t1 = (node.max.y - start.y) * inv_dir.y;
+    near = std::max(near, std::min(t0, t1)); far = std::min(far, std::max(t0, t1));
+    t0 = (node.min.z - start.z) * inv_dir.z; t1 = (node.max.z - start.z) * inv_dir.z;
+    near = std::max(near, std::min(t0, t1)); far = std::min(far, std::max(t0, t1));
+    t_near = near;
+    return near <= far;
+}
+
+void BVH::intersect(Ray& ray, const uint8_t* culled) const {
+    RenderStatistics* statistics = RenderStatistics::current;
+    for(Renderable* object : m_unbounded){
+        if(object->m_visible && object != ray.m_ignore){
+            bool hit = object->intersect(ray);
+            if(statistics){
+                statistics->intersection_tests++;
+                statistics->intersection_hits += hit;
+            }
+            if(ray.done()) return;
+        }
+    }
+    if(!m_node_count) return;
+
+    const Vec3<float> inv_dir = {1.0f / ray.m_dir.x, 1.0f / ray.m_dir.y, 1.0f / ray.m_dir.z};
+    struct entry { uint32_t node; float t; };
+    entry stack[max_stack_size];
+    size_t size = 0;
+
+    float t;
+    if(culled && culled[0]) return;
+    if(!hit_box(m_nodes[0], ray.m_start, inv_dir, ray.m_closest_distance, t)) return;
+    stack[size++] = {0, t};
+
+    while(size){
+        entry current = stack[--size];
+        //Skip nodes behind the closest intersection found so far.
+        if(current.t > ray.m_closest_distance) continue;
+        const BVHNode& node = m_nodes[current.node];
+
+        if(node.is_leaf()){
+            float t_hit[4 * max_leaf_size];
+            uint32_t hits = intersect_spheres(m_spheres, node.first, node.count, ray.m_start, ray.m_dir, ray.m_min_distance, ray.m_closest_distance, t_hit);
+            if(statistics){
+                statistics->intersection_tests += node.count;
+                statistics->intersection_hits += count_bits(hits);
+            }
+            while(hits){
+                uint32_t lane = count_trailing_zeros(hits);
+                hits &= hits - 1;
+                Renderable* object = m_primitives[node.first + lane];
+                if(object->m_visible && object != ray.m_ignore)
+                    ray.intersection({ray.m_start + ray.m_dir * t_hit[lane], object}, t_hit[lane]);
+            }
+            if(ray.done()) return;
+            if(m_has_generic){
+                for(uint32_t i = node.first; i < node.first + node.count; i++){
+                    Renderable* object = m_primitives[i];
+                    if(std::isnan(m_spheres.r2[i]) && object->m_visible && object != ray.m_ignore){
+                        //Already counted as test above.
+                        if(object->intersect(ray) && statistics) statistics->intersection_hits++;
+                        if(ray.done()) return;
+                    }
+                }
+            }
+            continue;
+        }
+
+        float t_left, t_right;
+        bool left = !(culled && culled[node.first]) && hit_box(m_nodes[node.first], ray.m_start, inv_dir, ray.m_closest_distance, t_left);
+        bool right = !(culled && culled[node.first + 1]) && hit_box(m_nodes[node.first + 1], ray.m_start, inv_dir, ray.m_closest_distance, t_right);
+        //Push farther child first so the nearer one is visited first.
+        if(left && right){
+            if(t_left <= t_right){
+                stack[size++] = {node.first + 1, t_right};
+                stack[size++] = {node.first, t_left};
+            } else {
+                stack[size++] = {node.first, t_left};
+                stack[size++] = {node.first + 1, t_right};
+            }
+        } else if(left)  stack[size++] = {node.first, t_left};
+        else if(right)   stack[size++] = {node.first + 1, t_right};
+    }
+}
+
+void BVH::intersect(RayPacket& packet, const uint8_t* culled) const {
+    if(!m_node_count) return;
+
+    struct entry { uint32_t node; float t; };
+    entry stack[max_stack_size];
+    size_t size = 0;
+
+    float t;
+    if(culled && culled[0]) return;
+    if(!intersect_box_packet(packet, m_nodes[0].min, m_nodes[0].max, t)) return;
+    stack[size++] = {0, t};
+
+    while(size){
+        entry current = stack[--size];
+        const BVHNode& node = m_nodes[current.node];
+
+        if(node.is_leaf()){
+            //The entry distance may be outdated, so test the leaf box again before its spheres.
+            if(current.node != 0 && !intersect_box_packet(packet, node.min, node.max, t)) continue;
+            if(RenderStatistics::current) RenderStatistics::current->intersection_tests += packet.size * node.count;
+            for(uint32_t i = node.first; i < node.first + node.count; i++){
+                if(m_primitives[i]->m_visible)
+                    intersect_sphere_packet(packet, m_spheres.x[i], m_spheres.y[i], m_spheres.z[i], m_spheres.r2[i], i);
+            }
+            continue;
+        }
+
+        float t_left, t_right;
+        bool left = !(culled && culled[node.first]) && intersect_box_packet(packet, m_nodes[node.first].min, m_nodes[node.first].max, t_left);
+        bool right = !(culled && culled[node.first + 1]) && intersect_box_packet(packet, m_nodes[node.first + 1].min, m_nodes[node.first + 1].max, t_right);
+        //Push farther child first so the nearer one is visited first.
+        if(left && right){
+            if(t_left <= t_right){
+                stack[size++] = {node.first + 1, t_right};
+                stack[size++] = {node.first, t_left};
+            } else {
+                stack[size++] = {node.first, t_left};
+                stack[size++] = {node.first + 1, t_right};
+            }
+        } else if(left)  stack[size++] = {node.first, t_left};
+        else if(right)   stack[size++] = {node.first + 1, t_right};
+    }
+}
@@ -0,0 +1,169 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "raytracer.h"
+#include "simd.h"
+#include "cache.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+/**
+ * @brief Node of a BVH. Inner nodes have count = 0 and their children stored next to each other
+ * at index first and first + 1. Leaves reference count primitives starting at index first.
+ */
+struct alignas(32) BVHNode {
+    Vec3<float> min;
+    uint32_t    first {0};
+    Vec3<float> max;
+    uint32_t    count {0};
+
+    inline bool is_leaf() const noexcept { return count != 0; }
+};
+
+/**
+ * @brief Bounding volume hierarchy over the renderable objects of a scene (binned SAH, flat node array).
+ */
+class BVH {
+protected:
+    /**
+     * @brief Nodes. Root is at index 0. Points into m_node_storage or into a mapped cache file.
+     */
+    const BVHNode*              m_nodes {nullptr};
+    size_t                      m_node_count {0};
+    /**
+     * @brief Index of each primitive in the list of bounded objects the BVH was built from. Points into
+     * m_index_storage or into a mapped cache file.
+     */
+    const uint32_t*             m_indices {nullptr};
+    std::vector<BVHNode>        m_node_storage;
+    std::vector<uint32_t>       m_index_storage;
+    /**
+     * @brief Cache file the BVH is using (nullptr if it has been built).
+     */
+    std::shared_ptr<MappedFile> m_mapping;
+    /**
+     * @brief Objects sorted by the leaves referencing them.
+     */
+    std::vector<Renderable*>    m_primitives;
+    /**
+     * @brief Sphere data in the order of m_primitives, tested by the SIMD kernel.
+     * Other primitives have a NaN radius here and are tested through Renderable::intersect.
+     */
+    SphereSoA                   m_spheres;
+    /**
+     * @brief True if any primitive is not a Sphere.
+     */
+    bool                        m_has_generic {false};
+    /**
+     * @brief Objects without finite bounds. Tested by every ray.
+     */
+    std::vector<Renderable*>    m_unbounded;
+    /**
+     * @brief Amount of primitives in the subtree of each node.
+     */
+    std::vector<uint32_t>       m_subtree_sizes;
+
+    /**
+     * @brief Builds BVH over bounded objects.
+     * @param bounded objects with finite bounds.
+     * @param boxes bounds of objects.
+     */
+    void build(const std::vector<Renderable*>& bounded, const std::vector<BoundingBox>& boxes);
+    /**
+     * @brief Uses BVH stored in cache file (zero-copy), if it has been built for the same objects.
+     * @param path path of cache file.
+     * @param hash content hash of bounded objects.
+     * @param bounded objects with finite bounds.
+     * @return true cache file is valid and used.
+     * @return false cache file is missing, outdated or broken. BVH is unchanged.
+     */
+    bool load(const char* path, uint64_t hash, const std::vector<Renderable*>& bounded);
+    /**
+     * @brief Writes BVH to cache file (replaced atomically by renaming a temporary file). Failures are reported, but not thrown.
+     * @param path path of cache file.
+     * @param hash content hash of bounded objects.
+     */
+    void save(const char* path, uint64_t hash) const;
+    /**
+     * @brief Calculates m_subtree_sizes from the nodes.
+     */
+    void count_subtrees();
+
+public:
+    /**
+     * @brief Max amount of primitives in leaves (unless splitting is more expensive). Leaves never exceed 4 times this.
+     */
+    static constexpr size_t max_leaf_size  {4};
+    /**
+     * @brief Amount of bins used for evaluating the surface area heuristic.
+     */
+    static constexpr size_t bin_count      {16};
+    /**
+     * @brief Version of cache file format. Has to be increased on any change of the format or of the build.
+     */
+    static constexpr uint32_t cache_version {1};
+
+    /**
+     * @brief Builds BVH of objects (in parallel on the global thread pool).
+     * @param objects objects to include.
+     * @param cache_path if not nullptr, the BVH is mapped from this file if it has been built for objects with the
+     * same content hash and cache version. Otherwise it is built and the file is (re-)written.
+     */
+    BVH(const std::vector<Renderable*>& objects, const char* cache_path = nullptr);
+
+    /**
+     * @brief Checks ray for intersections with all objects (= Intersection stage). Nodes are visited front-to-back,
+     * nodes behind the closest intersection found so far are skipped.
+     * @param ray Ray.
+     * @param culled if not nullptr, nodes marked by cull() are skipped (only for primary rays of the culled frame).
+     */
+    void intersect(Ray& ray, const uint8_t* culled = nullptr) const;
+    /**
+     * @brief Checks all lanes of a packet for intersections. Nodes are traversed once for the whole packet and
+     * skipped if no lane hits them. Only usable if supports_packets() is true.
+     * @param packet packet.
+     * @param culled if not nullptr, nodes marked by cull() are skipped (only for primary rays of the culled frame).
+     */
+    void intersect(RayPacket& packet, const uint8_t* culled = nullptr) const;
+    /**
+     * @brief Marks nodes outside the view frustum of a frame (frustum culling). Only nodes crossing the border of the
+     * frustum are descended into, so the cost depends on the border, not on the amount of primitives.
+     * @param frustum frustum of frame.
+     * @param culled receives one entry per node, 1 if primary rays of the frame can skip the node.
+     * @return size_t amount of bounded primitives outside the frustum.
+     */
+    size_t cull(const Frustum& frustum, std::vector<uint8_t>& culled) const;
+    /**
+     * @brief Checks if packets can be traced (all objects are spheres with finite bounds).
+     * @return true packets are supported.
+     */
+    inline bool supports_packets() const noexcept { return !m_has_generic && m_unbounded.empty(); }
+    /**
+     * @brief Get object by primitive index (as stored in RayPacket::hit).
+     * @param index primitive index.
+     * @return Renderable* object.
+     */
+    inline Renderable* primitive(uint32_t index) const noexcept { return m_primitives[index]; }
+
+    /**
+     * @brief Get amount of nodes.
+     * @return size_t amount of nodes.
+     */
+    inline size_t node_count() const noexcept { return m_node_count; }
+    /**
+     * @brief Get amount of bounded primitives.
+     * @return size_t amount of primitives.
+     */
+    inline size_t primitive_count() const noexcept { return m_primitives.size(); }
+    /**
+     * @brief Checks if BVH has been loaded from a cache file.
+     * @return true BVH is mapped from cache file.
+     */
+    inline bool cached() const noexcept { return m_mapping != nullptr; }
+};
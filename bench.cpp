@@ -0,0 +1,476 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+// Benchmark suite: runs kernels on procedural scenes and reports results as JSON.
+//
+//  raytracer_bench [--runs <n>] [--size <pixels>] [--filter <text>] [--out <file>]
+//
+// --runs    runs per benchmark (default 7). Median and deviation are taken over runs.
+// --size    width and height of rendered images (default 256).
+// --filter  only run benchmarks whose "<benchmark>/<scene>" name contains text.
+// --out     write JSON to file instead of stdout.
+//
+// On Linux, cache and TLB misses of each run are counted with perf events if the kernel allows it
+// (kernel.perf_event_paranoid <= 2); otherwise they are reported as null.
+
+#include "raytracer.h"
+#include "primitives.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief Generator of reproducible random numbers. Unlike std distributions, results are identical on all platforms.
+ */
+class SceneRandom {
+protected:
+    std::mt19937 m_engine;
+public:
+    SceneRandom(uint32_t seed) : m_engine{seed} {}
+    /**
+     * @brief Get random number in [from, to).
+     */
+    inline float uniform(float from, float to){
+        return from + (to - from) * ((float)(m_engine() >> 8) * (1.0f / 16777216.0f));
+    }
+};
+
+/**
+ * @brief Procedural benchmark scene.
+ */
+struct BenchScene {
+    std::string     name;
+    SceneData       scene;
+    Camera          camera;
+};
+
+/**
+ * @brief Random sphere field in front of the camera. Density = count / volume of field.
+ * @param count amount of spheres.
+ * @param depth extent of field along the view direction (x). Smaller values give denser fields.
+ * @param diffuseness_min min diffuseness of spheres (max is 1).
+ * @param light_count amount of lights.
+ * @param bounces max ray bounces of camera.
+ * @param seed random seed.
+ */
+static void generate(BenchScene& bench, size_t count, float depth, float diffuseness_min, size_t light_count, int bounces, uint32_t seed){
+    SceneRandom random(seed);
+    std::unique_ptr<Sphere[]> spheres(new Sphere[count]);
+    for(size_t i = 0; i < count; i++){
+        Sphere& sphere = spheres[i];
+        sphere.pos = {random.uniform(3, 3 + depth), random.uniform(-depth / 4, depth / 4), random.uniform(-depth / 4, depth / 4)};
+        sphere.radius = random.uniform(0.05f, 0.5f);
+        sphere.material.base_color = {random.uniform(0, 1), random.uniform(0, 1), random.uniform(0, 1)};
+        sphere.material.diffuseness = random.uniform(diffuseness_min, 1);
+    }
+    std::unique_ptr<Light[]> lights(new Light[light_count]);
+    for(size_t i = 0; i < light_count; i++){
+        Light& light = lights[i];
+        light.pos = {random.uniform(0, depth), random.uniform(-depth / 4, depth / 4), random.uniform(-depth / 4, depth / 4)};
+        light.color = {random.uniform(0.5f, 1), random.uniform(0.5f, 1), random.uniform(0.5f, 1)};
+        light.intensity = 1.0f / std::sqrt((float)light_count);
+        light.distance = 2 * depth;
+    }
+    bench.scene.adopt(std::move(spheres), count);
+    bench.scene.adopt(std::move(lights), light_count);
+    bench.camera.max_ray_bounces = bounces;
+}
+
+static std::vector<std::unique_ptr<BenchScene>> create_scenes(){
+    struct Config { const char* name; size_t count; float depth; float diffuseness_min; size_t lights; int bounces; };
+    static const Config configs[] = {
+        //Random sphere fields at different densities.
+        {"field_sparse",    10000,  200,    0.5f,   1,  3},
+        {"field_dense",     10000,  40,     0.5f,   1,  3},
+        {"field_large",     200000, 200,    0.5f,   1,  3},
+        //Mirrors only: every ray bounces until max_ray_bounces.
+        {"mirrors",         2000,   30,     0.0f,   1,  8},
+        //Many lights: one shadow ray per light and diffuse hit.
+        {"many_lights",     10000,  40,     1.0f,   64, 1},
+    };
+    std::vector<std::unique_ptr<BenchScene>> scenes;
+    uint32_t seed = 1;
+    for(const Config& config : configs){
+        std::unique_ptr<BenchScene> bench(new BenchScene);
+        bench->name = config.name;
+        generate(*bench, config.count, config.depth, config.diffuseness_min, config.lights, config.bounces, seed++);
+        scenes.push_back(std::move(bench));
+    }
+    return scenes;
+}
+
+/**
+ * @brief Hardware event counter of the calling process (user space only). Counts nothing if perf events are not
+ * available.
+ */
+class PerfCounter {
+protected:
+    int m_fd {-1};
+public:
+    /**
+     * @brief Open counter.
+     * @param type perf event type (e.g. PERF_TYPE_HARDWARE).
+     * @param config event (e.g. PERF_COUNT_HW_CACHE_MISSES).
+     */
+    PerfCounter(uint32_t type, uint64_t config){
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        //Count threads created later as well (render workers).
+        attr.inherit = 1;
+        m_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+    ~PerfCounter(){
+#ifdef __linux__
+        if(m_fd >= 0) close(m_fd);
+#endif
+    }
+    inline bool available() const noexcept { return m_fd >= 0; }
+    void start(){
+#ifdef __linux__
+        if(m_fd < 0) return;
+        ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    /**
+     * @brief Stop counting.
+     * @return double events since start(). -1 if not available.
+     */
+    double stop(){
+#ifdef __linux__
+        if(m_fd < 0) return -1;
+        ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        if(read(m_fd, &count, sizeof(count)) != sizeof(count)) return -1;
+        return (double)count;
+#else
+        return -1;
+#endif
+    }
+};
+
+/**
+ * @brief Results of all runs of one benchmark.
+ */
+struct BenchResult {
+    std::string         benchmark, scene;
+    /**
+     * @brief Rays (or intersection tests) per run.
+     */
+    size_t              rays {0};
+    /**
+     * @brief Rays per second of each run.
+     */
+    std::vector<double> rays_per_second;
+    /**
+     * @brief Last level cache misses and data TLB misses of each run (empty if not available).
+     */
+    std::vector<double> cache_misses, tlb_misses;
+};
+
+/**
+ * @brief Runs function several times and measures it.
+ * @param scene name of scene (or variant) in results.
+ * @param run performs one run and returns the amount of rays traced.
+ */
+template<typename F> static BenchResult measure(const char* benchmark, const std::string& scene, size_t runs, F run){
+    BenchResult result;
+    result.benchmark = benchmark;
+    result.scene = scene;
+#ifdef __linux__
+    PerfCounter cache_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    PerfCounter tlb_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+    PerfCounter cache_counter(0, 0), tlb_counter(0, 0);
+#endif
+    //Warm up caches and thread pool.
+    run();
+    for(size_t i = 0; i < runs; i++){
+        cache_counter.start();
+        tlb_counter.start();
+        Clock clock;
+        result.rays = run();
+        double time = clock.stop();
+        double cache_misses = cache_counter.stop(), tlb_misses = tlb_counter.stop();
+        result.rays_per_second.push_back(result.rays / (time / 1000000000));
+        if(cache_misses >= 0) result.cache_misses.push_back(cache_misses);
+        if(tlb_misses >= 0) result.tlb_misses.push_back(tlb_misses);
+    }
+    return result;
+}
+
+/**
+ * @brief Median of values.
+ */
+static double median(std::vector<double> values){
+    if(values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values.size() % 2 ? values[values.size() / 2] : (values[values.size() / 2 - 1] + values[values.size() / 2]) / 2;
+}
+
+/**
+ * @brief Directions of primary rays through a width x height grid on the default view plane.
+ */
+static std::vector<Vec3<float>> primary_directions(size_t size){
+    std::vector<Vec3<float>> directions;
+    directions.reserve(size * size);
+    for(size_t y = 0; y < size; y++)
+        for(size_t x = 0; x < size; x++){
+            Vec3<float> dir = {1.0f, (float)x / size - 0.5f, 0.5f - (float)y / size};
+            directions.push_back(dir.norm());
+        }
+    return directions;
+}
+
+static void write_json(std::ostream& out, const std::vector<BenchResult>& results, size_t runs, size_t size){
+    out << "{\n  \"version\": 1,\n  \"runs\": " << runs << ",\n  \"size\": " << size
+        << ",\n  \"threads\": " << work_stealing_scheduler().thread_count() << ",\n  \"results\": [";
+    for(size_t i = 0; i < results.size(); i++){
+        const BenchResult& result = results[i];
+        const std::vector<double>& samples = result.rays_per_second;
+        double median_rate = median(samples);
+        double mean = 0, variance = 0;
+        for(double r : samples) mean += r;
+        mean /= samples.size();
+        for(double r : samples) variance += (r - mean) * (r - mean);
+        variance = samples.size() > 1 ? variance / (samples.size() - 1) : 0;
+
+        out << (i ? "," : "") << "\n    {\"benchmark\": \"" << result.benchmark << "\", \"scene\": \"" << result.scene
+            << "\", \"rays\": " << result.rays
+            << ", \"median_rays_per_second\": " << median_rate
+            << ", \"median_ns_per_ray\": " << (median_rate > 0 ? 1e9 / median_rate : 0)
+            << ", \"variance\": " << variance
+            << ", \"relative_stddev\": " << (mean > 0 ? std::sqrt(variance) / mean : 0);
+        //Misses per ray (null if not counted).
+        out << ", \"median_cache_misses_per_ray\": ";
+        if(result.cache_misses.empty()) out << "null";
+        else/************************/ out << median(result.cache_misses) / result.rays;
+        out << ", \"median_tlb_misses_per_ray\": ";
+        if(result.tlb_misses.empty()) out << "null";
+        else/**********************/ out << median(result.tlb_misses) / result.rays;
+        out << ", \"rays_per_second\": [";
+        for(size_t j = 0; j < result.rays_per_second.size(); j++)
+            out << (j ? ", " : "") << result.rays_per_second[j];
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv){
+    size_t runs = 7, size = 256;
+    const char* filter = nullptr;
+    const char* out_location = nullptr;
+    for(int i = 1; i < argc; i++){
+        bool has_value = i + 1 < argc;
+        if(!std::strcmp(argv[i], "--runs") && has_value)        runs = std::max(1, std::atoi(argv[++i]));
+        else if(!std::strcmp(argv[i], "--size") && has_value)   size = std::max(1, std::atoi(argv[++i]));
+        else if(!std::strcmp(argv[i], "--filter") && has_value) filter = argv[++i];
+        else if(!std::strcmp(argv[i], "--out") && has_value)    out_location = argv[++i];
+        else {
+            std::cerr << "Usage: raytracer_bench [--runs <n>] [--size <pixels>] [--filter <text>] [--out <file>]" << std::endl;
+            return 1;
+        }
+    }
+    auto selected = [&](const char* benchmark, const BenchScene& scene){
+        return !filter || (std::string(benchmark) + "/" + scene.name).find(filter) != std::string::npos;
+    };
+
+    //Silence progress output of the renderer. Progress of the benchmark goes to stderr.
+    std::ostringstream discard;
+    std::streambuf* cout_buffer = std::cout.rdbuf(discard.rdbuf());
+
+    std::vector<BenchResult> results;
+    const std::vector<Vec3<float>> directions = primary_directions(size);
+
+    //Image access of tile rendering on a large image: Write tiles of 16x16 pixels in scheduler order, then compare
+    //every pixel to its neighbors like supersampling does. Counts pixels; scene name is the image layout.
+    const struct { const char* name; ImageLayout layout; } layouts[] = {{"linear", ImageLayout::linear}, {"tiled", ImageLayout::tiled}};
+    for(const auto& layout : layouts){
+        if(filter && (std::string("image_tiles/") + layout.name).find(filter) == std::string::npos) continue;
+        std::cerr << "image_tiles/" << layout.name << std::endl;
+        const size_t image_size = 4096, tile = 16;
+        Image img(image_size, image_size, layout.layout);
+        results.push_back(measure("image_tiles", layout.name, runs, [&](){
+            const size_t tiles = image_size / tile;
+            float contrast = 0;
+            for(size_t t = 0; t < tiles * tiles; t++){
+                size_t x0 = (t % tiles) * tile, y0 = (t / tiles) * tile;
+                for(size_t y = y0; y < y0 + tile; y++)
+                    for(size_t x = x0; x < x0 + tile; x++)
+                        img(x, y) = Color{(float)x, (float)y, (float)t};
+            }
+            for(size_t t = 0; t < tiles * tiles; t++){
+                size_t x0 = (t % tiles) * tile, y0 = (t / tiles) * tile;
+                for(size_t y = std::max<size_t>(y0, 1); y < std::min(y0 + tile, image_size - 1); y++)
+                    for(size_t x = std::max<size_t>(x0, 1); x < std::min(x0 + tile, image_size - 1); x++){
+                        float c = img(x, y).brightness();
+                        contrast += std::fabs(c - img(x - 1, y).brightness()) + std::fabs(c - img(x + 1, y).brightness())
+                                  + std::fabs(c - img(x, y - 1).brightness()) + std::fabs(c - img(x, y + 1).brightness());
+                    }
+            }
+            if(contrast < 0) std::cerr << contrast;
+            return image_size * image_size;
+        }));
+    }
+    //View::rays: Primary ray generation of a full frame in row batches, pinhole and orthographic camera.
+    const struct { const char* name; Projection projection; } projections[] = {{"pinhole", Projection::pinhole}, {"orthographic", Projection::orthographic}};
+    for(const auto& projection : projections){
+        if(filter && (std::string("camera_rays/") + projection.name).find(filter) == std::string::npos) continue;
+        std::cerr << "camera_rays/" << projection.name << std::endl;
+        Camera camera;
+        camera.rot = {10, 20, 30};
+        camera.projection = projection.projection;
+        const View view(camera, size, size);
+        const size_t batch = 64;
+        std::vector<float> rays(6 * batch);
+        results.push_back(measure("camera_rays", projection.name, runs, [&](){
+            float sum = 0;
+            for(size_t y = 0; y < size; y++)
+                for(size_t x = 0; x < size; x += batch){
+                    float* r = rays.data();
+                    view.rays(x, y, std::min(batch, size - x), r, r + batch, r + 2 * batch, r + 3 * batch, r + 4 * batch, r + 5 * batch);
+                    sum += r[3 * batch];
+                }
+            if(sum == INFINITY) std::cerr << sum;
+            return size * size;
+        }));
+    }
+
+    for(auto& bench : create_scenes()){
+        bench->scene.build_acceleration();
+
+        //Sphere::intersect: Primary rays against the first spheres of the scene (no acceleration structure).
+        if(selected("sphere_intersect", *bench)){
+            std::cerr << "sphere_intersect/" << bench->name << std::endl;
+            std::vector<Renderable*> objects(bench->scene.m_render_list.begin(),
+                                             bench->scene.m_render_list.begin() + std::min<size_t>(bench->scene.m_render_list.size(), 64));
+            results.push_back(measure("sphere_intersect", bench->name, runs, [&](){
+                size_t hits = 0;
+                for(const Vec3<float>& dir : directions){
+                    Ray ray(0, bench->camera.pos, dir);
+                    for(Renderable* object : objects) hits += object->intersect(ray);
+                }
+                if(hits == SIZE_MAX) std::cerr << hits;
+                return directions.size() * objects.size();
+            }));
+        }
+
+        //PrimitiveStore: The same spheres tested as one batch of their type (no virtual calls, SIMD kernel).
+        if(selected("sphere_batch", *bench)){
+            std::cerr << "sphere_batch/" << bench->name << std::endl;
+            std::vector<Renderable*> objects(bench->scene.m_render_list.begin(),
+                                             bench->scene.m_render_list.begin() + std::min<size_t>(bench->scene.m_render_list.size(), 64));
+            PrimitiveStore store(objects, 0);
+            results.push_back(measure("sphere_batch", bench->name, runs, [&](){
+                size_t hits = 0;
+                for(const Vec3<float>& dir : directions){
+                    Ray ray(0, bench->camera.pos, dir);
+                    store.intersect(ray);
+                    hits += ray.m_closest.object != nullptr;
+                }
+                if(hits == SIZE_MAX) std::cerr << hits;
+                return directions.size() * objects.size();
+            }));
+        }
+
+        //Ray::fire: Primary rays including materialization (single thread, BVH).
+        if(selected("ray_fire", *bench)){
+            std::cerr << "ray_fire/" << bench->name << std::endl;
+            results.push_back(measure("ray_fire", bench->name, runs, [&](){
+                float sum = 0;
+                for(const Vec3<float>& dir : directions){
+                    Ray ray(bench->camera.max_ray_bounces, bench->camera.pos, dir);
+                    sum += ray.fire(bench->scene).r;
+                }
+                if(sum < 0) std::cerr << sum;
+                return directions.size();
+            }));
+        }
+
+        //Raytracer::render: Full frame on all threads. Counts primary rays.
+        if(selected("render", *bench)){
+            std::cerr << "render/" << bench->name << std::endl;
+            Image img(size, size);
+            Raytracer tracer(&img);
+            tracer.scene = std::move(bench->scene);
+            tracer.camera = bench->camera;
+            results.push_back(measure("render", bench->name, runs, [&](){
+                tracer.scene.mark_dirty(dirty_all);
+                tracer.render();
+                return size * size;
+            }));
+            bench->scene = std::move(tracer.scene);
+        }
+
+        //Raytracer::render without acceleration structure: Rays test the PrimitiveStore of the scene (primary rays the
+        //one of culled objects). Smaller image and only scenes of up to 10000 objects, since every ray tests all objects.
+        if(selected("render_linear", *bench) && bench->scene.m_render_list.size() <= 10000){
+            std::cerr << "render_linear/" << bench->name << std::endl;
+            const size_t linear_size = std::max<size_t>(size / 8, 1);
+            Image img(linear_size, linear_size);
+            Raytracer tracer(&img);
+            tracer.scene = std::move(bench->scene);
+            tracer.camera = bench->camera;
+            tracer.use_acceleration = false;
+            results.push_back(measure("render_linear", bench->name, runs, [&](){
+                tracer.scene.mark_dirty(dirty_all);
+                tracer.render();
+                return linear_size * linear_size;
+            }));
+            bench->scene = std::move(tracer.scene);
+        }
+
+        //Raytracer::render in wavefront mode (64x64 pixel queues). Counts primary rays.
+        if(selected("render_wavefront", *bench)){
+            std::cerr << "render_wavefront/" << bench->name << std::endl;
+            Image img(size, size);
+            Raytracer tracer(&img);
+            tracer.scene = std::move(bench->scene);
+            tracer.camera = bench->camera;
+            tracer.wavefront_tile = 64;
+            results.push_back(measure("render_wavefront", bench->name, runs, [&](){
+                tracer.scene.mark_dirty(dirty_all);
+                tracer.render();
+                return size * size;
+            }));
+            bench->scene = std::move(tracer.scene);
+        }
+    }
+
+    std::cout.rdbuf(cout_buffer);
+    if(out_location){
+        std::ofstream out(out_location);
+        if(!out){
+            std::cerr << "Cannot open output file." << std::endl;
+            return 1;
+        }
+        write_json(out, results, runs, size);
+    } else write_json(std::cout, results, runs, size);
+    return 0;
+}
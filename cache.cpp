@@ -0,0 +1,90 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "cache.h"
+#ifdef _WIN32
+//Keep std::min and std::max usable.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char* path){
+    close();
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0){
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(!mapping){
+        CloseHandle(file);
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!data){
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = (size_t)size.QuadPart;
+    return true;
+}
+
+void MappedFile::close(){
+    if(m_data) UnmapViewOfFile(m_data);
+    if(m_mapping) CloseHandle(m_mapping);
+    if(m_file) CloseHandle(m_file);
+    m_data = nullptr;
+    m_mapping = m_file = nullptr;
+    m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const char* path){
+    close();
+    int file = ::open(path, O_RDONLY);
+    if(file < 0) return false;
+    struct stat info;
+    if(fstat(file, &info) != 0 || info.st_size == 0){
+        ::close(file);
+        return false;
+    }
+    void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    //The mapping stays valid after closing the file descriptor.
+    ::close(file);
+    if(data == MAP_FAILED) return false;
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = (size_t)info.st_size;
+    return true;
+}
+
+void MappedFile::close(){
+    if(m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile(){
+    close();
+}
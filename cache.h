@@ -0,0 +1,78 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Read-only memory mapping of a whole file.
+ */
+class MappedFile {
+protected:
+    const uint8_t*  m_data {nullptr};
+    size_t          m_size {0};
+#ifdef _WIN32
+    void*           m_file {nullptr};
+    void*           m_mapping {nullptr};
+#endif
+public:
+    /**
+     * @brief Maps file into memory.
+     * @param path file path.
+     * @return true file has been mapped.
+     * @return false file does not exist or could not be mapped.
+     */
+    bool open(const char* path);
+    /**
+     * @brief Unmaps file (called by destructor).
+     */
+    void close();
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    /**
+     * @brief Get mapped memory (page aligned).
+     * @return const uint8_t* start of file. nullptr if no file is mapped.
+     */
+    inline const uint8_t* data() const noexcept { return m_data; }
+    /**
+     * @brief Get size of mapped file.
+     * @return size_t size in bytes.
+     */
+    inline size_t size() const noexcept { return m_size; }
+};
+
+/**
+ * @brief 64-bit content hash (FNV-1a over 32-bit words). Used to identify data cached on disk.
+ */
+class ContentHash {
+protected:
+    uint64_t m_hash {0xcbf29ce484222325ull};
+public:
+    inline void add(uint32_t word) noexcept {
+        m_hash = (m_hash ^ word) * 0x100000001b3ull;
+    }
+    inline void add(float f) noexcept {
+        uint32_t word;
+        std::memcpy(&word, &f, sizeof(word));
+        add(word);
+    }
+    inline void add(uint64_t word) noexcept {
+        add((uint32_t)word);
+        add((uint32_t)(word >> 32));
+    }
+    /**
+     * @brief Get hash of all values added so far.
+     * @return uint64_t hash.
+     */
+    inline uint64_t value() const noexcept { return m_hash; }
+};
@@ -0,0 +1,127 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "camera.h"
+#ifdef RAYTRACER_X86
+#include <xmmintrin.h>
+#endif
+
+/**
+ * @brief Rotate vector by angles (degrees) in the order and directions of rotate(): z first (x towards y), then y
+ * (x towards z), then x (y towards z).
+ */
+static Vec3<float> rotate_vector(Vec3<float> v, const float (&s)[3], const float (&c)[3]){
+    v = {v.x * c[2] - v.y * s[2], v.x * s[2] + v.y * c[2], v.z};
+    v = {v.x * c[1] - v.z * s[1], v.y, v.x * s[1] + v.z * c[1]};
+    v = {v.x, v.y * c[0] - v.z * s[0], v.y * s[0] + v.z * c[0]};
+    return v;
+}
+
+View::View(const Camera& camera, size_t width, size_t height)
+: projection{camera.projection}, origin{camera.pos}
+{
+    //Basis: Sines and cosines are calculated once per frame.
+    const float angles[3] = {radians(camera.rot.x), radians(camera.rot.y), radians(camera.rot.z)};
+    float s[3], c[3];
+    for(size_t i = 0; i < 3; i++){
+        s[i] = std::sin(angles[i]);
+        c[i] = std::cos(angles[i]);
+    }
+    forward = rotate_vector({1, 0, 0}, s, c);
+    right = rotate_vector({0, 1, 0}, s, c);
+    up = rotate_vector({0, 0, 1}, s, c);
+
+    //Calculate view plane (=perspective) of view.
+    const float half_width = camera.view_plane.x / 2, half_height = camera.view_plane.y / 2;
+    Vec3<float> center = forward * camera.distance;
+    ul = center - right * half_width + up * half_height;    //    ul ------------ ur
+    ur = center + right * half_width + up * half_height;    //    |               |
+    ll = center - right * half_width - up * half_height;    //    |               |
+    lr = center + right * half_width - up * half_height;    //    ll ------------ lr
+
+    step_x = right * (camera.view_plane.x / (float)width);
+    step_y = up * (-camera.view_plane.y / (float)height);
+    if(projection == Projection::orthographic)
+        corner = camera.pos - right * half_width + up * half_height;
+    else/************************************/
+        corner = ul;
+}
+
+Frustum::Frustum(const Camera& camera, const View& view){
+    auto plane = [&](const Vec3<float>& normal, const Vec3<float>& point){
+        normals[count] = normal.norm();
+        points[count++] = point;
+    };
+    if(view.projection == Projection::orthographic){
+        //Rays start on the view plane rectangle around the camera and run forward.
+        const float half_width = camera.view_plane.x / 2, half_height = camera.view_plane.y / 2;
+        plane(view.forward, view.origin);
+        plane(view.right, view.origin - view.right * half_width);
+        plane(view.right * -1, view.origin + view.right * half_width);
+        plane(view.up, view.origin - view.up * half_height);
+        plane(view.up * -1, view.origin + view.up * half_height);
+        return;
+    }
+    //Pinhole: Rays form a pyramid from the camera through the corners of the view plane.
+    const Vec3<float> inside = view.ul + view.lr;
+    const Vec3<float> edges[4][2] = {{view.ul, view.ur}, {view.ur, view.lr}, {view.lr, view.ll}, {view.ll, view.ul}};
+    for(const auto& edge : edges){
+        Vec3<float> normal = edge[0].cross(edge[1]);
+        if(normal.dot(inside) < 0) normal = normal * -1;
+        plane(normal, view.origin);
+    }
+}
+
+int Frustum::classify(const Vec3<float>& min, const Vec3<float>& max) const noexcept {
+    const Vec3<float> center = (max + min) * 0.5f, extent = (max - min) * 0.5f;
+    int result = 1;
+    for(size_t i = 0; i < count; i++){
+        const Vec3<float>& n = normals[i];
+        Vec3<float> to_center = center - points[i];
+        float distance = n.dot(to_center);
+        float radius = std::abs(n.x) * extent.x + std::abs(n.y) * extent.y + std::abs(n.z) * extent.z;
+        //Tolerance for rounding of planes and rays.
+        float tolerance = 1e-4f * (to_center.length() + extent.length());
+        if(distance + radius < -tolerance) return -1;
+        if(distance - radius <= tolerance) result = 0;
+    }
+    return result;
+}
+
+void View::rays(size_t x, size_t y, size_t count, float* ox, float* oy, float* oz, float* dx, float* dy, float* dz) const noexcept {
+    const float fy = (float)y;
+    const Vec3<float> row = {corner.x + step_y.x * fy, corner.y + step_y.y * fy, corner.z + step_y.z * fy};
+    const bool orthographic = projection == Projection::orthographic;
+    size_t i = 0;
+#ifdef RAYTRACER_X86
+    const __m128 row_x = _mm_set1_ps(row.x), row_y = _mm_set1_ps(row.y), row_z = _mm_set1_ps(row.z);
+    const __m128 step_xx = _mm_set1_ps(step_x.x), step_xy = _mm_set1_ps(step_x.y), step_xz = _mm_set1_ps(step_x.z);
+    const __m128 four = _mm_set1_ps(4);
+    __m128 column = _mm_setr_ps((float)x, (float)(x + 1), (float)(x + 2), (float)(x + 3));
+    for(; i + 4 <= count; i += 4){
+        __m128 vx = _mm_add_ps(row_x, _mm_mul_ps(step_xx, column));
+        __m128 vy = _mm_add_ps(row_y, _mm_mul_ps(step_xy, column));
+        __m128 vz = _mm_add_ps(row_z, _mm_mul_ps(step_xz, column));
+        //Next columns. Exact as long as column numbers fit into the float mantissa.
+        column = _mm_add_ps(column, four);
+        if(orthographic){
+            _mm_storeu_ps(ox + i, vx); _mm_storeu_ps(oy + i, vy); _mm_storeu_ps(oz + i, vz);
+            _mm_storeu_ps(dx + i, _mm_set1_ps(forward.x)); _mm_storeu_ps(dy + i, _mm_set1_ps(forward.y)); _mm_storeu_ps(dz + i, _mm_set1_ps(forward.z));
+            continue;
+        }
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+        _mm_storeu_ps(ox + i, _mm_set1_ps(origin.x)); _mm_storeu_ps(oy + i, _mm_set1_ps(origin.y)); _mm_storeu_ps(oz + i, _mm_set1_ps(origin.z));
+        _mm_storeu_ps(dx + i, _mm_div_ps(vx, length)); _mm_storeu_ps(dy + i, _mm_div_ps(vy, length)); _mm_storeu_ps(dz + i, _mm_div_ps(vz, length));
+    }
+#endif
+    for(; i < count; i++){
+        Vec3<float> start, dir;
+        ray((float)(x + i), fy, start, dir);
+        ox[i] = start.x; oy[i] = start.y; oz[i] = start.z;
+        dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+    }
+}
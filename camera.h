@@ -0,0 +1,144 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "math.h"
+#include <cstddef>
+
+/**
+ * @brief Transformation of an object (position, rotation, scale)
+ */
+struct Transform{
+    Vec3<float> pos, rot, scale;
+};
+
+/**
+ * @brief How primary rays leave the camera.
+ */
+enum class Projection {
+    /**
+     * @brief All rays start at the camera position and pass through the view plane (perspective).
+     */
+    pinhole,
+    /**
+     * @brief Rays start on the view plane (centered at the camera position) and are parallel to the view direction.
+     */
+    orthographic
+};
+
+/**
+ * @brief Raw camera data. View is calculated in rendering process.
+ */
+struct Camera : Transform {
+    /**
+     * @brief Max amount of ray bounces before Ray terminates. Higher values result in better graphics.
+     */
+    int         max_ray_bounces {3};
+    /**
+     * @brief Height and Width of view plane. Used for calculating camera rays.
+     */
+    Vec2<float> view_plane      {1, 1};
+    /**
+     * @brief Distance from camera origin to view plane. (=Field of view)
+     */
+    float       distance        {1.0f};
+    /**
+     * @brief Projection of primary rays.
+     */
+    Projection  projection      {Projection::pinhole};
+};
+
+/**
+ * @brief View Vectors of Camera. Calculated once per frame; primary rays are generated from it by adding per-column
+ * and per-row steps (no trigonometry or rotation per pixel).
+ */
+struct View {
+    /**
+     * @brief Corners of view plane relative to the camera position (rotated).
+     */
+    Vec3<float> ul, ur, ll, lr;
+    /**
+     * @brief Orthonormal camera basis: view direction, direction of columns (right) and of rows (up) of the image.
+     */
+    Vec3<float> forward {1, 0, 0}, right {0, 1, 0}, up {0, 0, 1};
+    Projection  projection {Projection::pinhole};
+    /**
+     * @brief Start of all rays (pinhole).
+     */
+    Vec3<float> origin;
+    /**
+     * @brief Pinhole: direction (not normalized) through pixel (0, 0). Orthographic: start of ray of pixel (0, 0).
+     */
+    Vec3<float> corner;
+    /**
+     * @brief Change of corner per column and per row.
+     */
+    Vec3<float> step_x, step_y;
+
+    View() = default;
+    /**
+     * @brief Calculate view of camera for a frame.
+     * @param camera camera.
+     * @param width width of frame in pixels.
+     * @param height height of frame in pixels.
+     */
+    View(const Camera& camera, size_t width, size_t height);
+
+    /**
+     * @brief Calculate primary ray through a position on the image (in pixels, may be fractional).
+     * @param x column.
+     * @param y row.
+     * @param start receives start of ray.
+     * @param dir receives normalized direction of ray.
+     */
+    inline void ray(float x, float y, Vec3<float>& start, Vec3<float>& dir) const noexcept {
+        //Same operations as rays(), so single rays and batches are bit-identical.
+        Vec3<float> row = {corner.x + step_y.x * y, corner.y + step_y.y * y, corner.z + step_y.z * y};
+        Vec3<float> v = {row.x + step_x.x * x, row.y + step_x.y * x, row.z + step_x.z * x};
+        if(projection == Projection::orthographic){
+            start = v;
+            dir = forward;
+            return;
+        }
+        float length = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+        start = origin;
+        dir = {v.x / length, v.y / length, v.z / length};
+    }
+
+    /**
+     * @brief Calculate primary rays of consecutive pixels of a row (vectorized). Output is stored as structure of arrays.
+     * @param x first column.
+     * @param y row.
+     * @param count amount of pixels.
+     * @param ox, oy, oz receive start points.
+     * @param dx, dy, dz receive normalized directions.
+     */
+    void rays(size_t x, size_t y, size_t count, float* ox, float* oy, float* oz, float* dx, float* dy, float* dz) const noexcept;
+};
+
+/**
+ * @brief Planes bounding the primary rays of a frame (normals point inside). Calculated once per frame for culling.
+ */
+struct Frustum {
+    Vec3<float> normals[5], points[5];
+    size_t      count {0};
+
+    /**
+     * @brief Calculate planes of view of camera.
+     * @param camera camera.
+     * @param view view of camera for the frame.
+     */
+    Frustum(const Camera& camera, const View& view);
+
+    /**
+     * @brief Classifies an axis-aligned box. Conservative: boxes close to a plane are intersecting.
+     * @param min corner with smallest coordinates.
+     * @param max corner with largest coordinates.
+     * @return int -1 box is outside, 1 box is completely inside, 0 box intersects the border of the frustum.
+     */
+    int classify(const Vec3<float>& min, const Vec3<float>& max) const noexcept;
+};
@@ -6,49 +6,62 @@
 //  https://github.com/danielmehlber                                     
 
 #include <iostream>
+#include <cstring>
 #include "raytracer.h"
+#include "scene.h"
 
 
 int main(int argc, char** argv){
 
-
-    const char* out_location = argv[1];
-
-    if(!out_location) out_location = "result.ppm";
+    const char* scene_location = nullptr;
+    const char* out_location = "result.ppm";
+    const char* trace_location = nullptr;
+    const char* cache_location = nullptr;
+    bool heatmap = false;
+    bool stats = false;
+    int positional = 0;
+    for(int i = 1; i < argc; i++){
+        if(!std::strcmp(argv[i], "--trace") && i + 1 < argc)            trace_location = argv[++i];
+        else if(!std::strcmp(argv[i], "--bvh-cache") && i + 1 < argc)   cache_location = argv[++i];
+        else if(!std::strcmp(argv[i], "--heatmap"))                     heatmap = true;
+        else if(!std::strcmp(argv[i], "--stats"))                       stats = true;
+        else if(positional == 0)                                        scene_location = argv[i], positional++;
+        else if(positional == 1)                                        out_location = argv[i], positional++;
+        else                                                            scene_location = nullptr;
+    }
+    if(!scene_location){
+        std::cerr << "Usage: raytracer <scene file> [output file] [--trace <trace file>] [--bvh-cache <cache file>] [--heatmap] [--stats]"
+                  << std::endl;
+        return 1;
+    }
+    //Record timeline of setup, rendering and output (Chrome trace event format).
+    if(trace_location) Profiler::enable();
 
     std::cout << "Raytracer started" << std::endl;
 
-    Image img(500,500);
-
-    Raytracer tracer(&img);
-
-    Sphere sphere1; sphere1.radius = 1.5f;
-    sphere1.pos = {6, -1.5f, 0};
-    sphere1.material.base_color = {1, 0, 0};
-    sphere1.material.diffuseness = 0;
-    tracer.scene.add(&sphere1);
-
-    Sphere sphere2; sphere2.radius = 1.5f;
-    sphere2.pos = {6.5f, 1.5f, 1.0f};
-    sphere2.material.base_color = {0, 0, 1};
-    sphere2.material.diffuseness = 1;
-    tracer.scene.add(&sphere2);
-
-    Sphere sphere3; sphere3.radius = 0.1f;
-    sphere3.pos = {4, 0.8f, 0.8f};
-    sphere3.material.base_color = {0, 1, 0};
-    tracer.scene.add(&sphere3);
+    SceneData scene;
+    Camera camera;
+    SceneFileInfo info;
+    try{
+        Clock load_clock;
+        info = load_scene(scene_location, scene, camera);
+        auto load_time = load_clock.stop();
+        std::cout << "Scene loaded: " << info.spheres << " spheres, " << info.lights << " lights, " << info.materials
+                  << " materials in " << (load_time/1000000) << "ms" << std::endl;
+    } catch(const char* e) {
+        std::cerr << e << std::endl;
+        return 1;
+    }
 
-    Light light1; light1.pos = {3,2,1};
-    light1.color = {1, 1, 1};
-    light1.distance = 20;
-    light1.intensity = 1.0f;
-    tracer.scene.add(&light1);
+    Image img(info.width, info.height);
 
-    Light light2; light2.pos = {0, 0.5f, 1};
-    light2.color = {1, 0, 0};
-    light2.distance = 20;
-    //tracer.scene.add(&light2);
+    Raytracer tracer(&img);
+    tracer.scene = std::move(scene);
+    tracer.camera = camera;
+    //Geometry of scene files rarely changes between runs.
+    if(cache_location) tracer.acceleration_cache = cache_location;
+    tracer.record_cost = heatmap;
+    tracer.collect_statistics = stats;
 
 #ifdef _WIN32
 
@@ -72,7 +85,29 @@ int main(int argc, char** argv){
     } catch(const char* e) {
         std::cerr << e << std::endl;
     } 
-    std::cout << "finished. Raytracer is terminating..." << std::endl;
+    std::cout << "finished." << std::endl;
+    if(heatmap){
+        //Heatmaps are written next to the output: <output without extension>.<metric>.ppm
+        std::string base = out_location;
+        size_t dot = base.find_last_of('.');
+        if(dot != std::string::npos && base.find_first_of("/\\", dot) == std::string::npos) base.resize(dot);
+        try{
+            tracer.write_heatmap((base + ".tests.ppm").c_str(), CostMetric::intersection_tests);
+            tracer.write_heatmap((base + ".reflections.ppm").c_str(), CostMetric::reflection_rays);
+            tracer.write_heatmap((base + ".cycles.ppm").c_str(), CostMetric::cycles);
+        } catch(const char* e) {
+            std::cerr << e << std::endl;
+        }
+    }
+    if(trace_location){
+        try{
+            Profiler::write_chrome_trace(trace_location);
+            std::cout << "Trace written to '" << trace_location << "'." << std::endl;
+        } catch(const char* e) {
+            std::cerr << e << std::endl;
+        }
+    }
+    std::cout << "Raytracer is terminating..." << std::endl;
 #endif
     return 0;
 }
\ No newline at end of file
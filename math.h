@@ -8,8 +8,18 @@
 #pragma once
 #include <memory>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 #include "stdlib.h"
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RAYTRACER_X86
+#endif
+
+#ifdef RAYTRACER_X86
+#include <xmmintrin.h>
+#endif
+
 template <typename T> class Matrix;
 template <typename T> struct Vec2;
 template <typename T> struct Vec3;
@@ -28,7 +38,7 @@ template<typename T> inline T random(T from, T to){
 }
 
 template<typename T> struct Vec3{
-    T x = NULL, y = NULL, z = NULL;
+    T x {}, y {}, z {};
 
     inline operator Matrix<T>() {
         Matrix<T> r(1, 3);
@@ -38,33 +48,42 @@ template<typename T> struct Vec3{
         return r;
     }
 
-    inline float length() const noexcept {
+    inline T length() const noexcept {
         return std::sqrt(x*x + y*y + z*z);
     }
 
-    inline Vec3<T> norm() const {
-        auto len = length();
-        if(len == 0)    throw "Cannot normalize Vec3 of length 0.";
-        else/******/    return {x/len, y/len, z/len};
+    inline T length_squared() const noexcept {
+        return x*x + y*y + z*z;
     }
 
-    inline Vec3<T> operator-(const Vec3<T>& vec) const {
+    /**
+     * @brief Get vector of length 1 in the same direction. The zero vector stays the zero vector (it is divided by
+     * infinity instead of 0). Branch-free for Vec3<float> on x86.
+     * @return Vec3<T> normalized vector.
+     */
+    inline Vec3<T> norm() const noexcept {
+        T len = length();
+        len = len > 0 ? len : std::numeric_limits<T>::infinity();
+        return {x/len, y/len, z/len};
+    }
+
+    inline Vec3<T> operator-(const Vec3<T>& vec) const noexcept {
         return {x - vec.x, y - vec.y, z - vec.z};
     }
 
-    inline Vec3<T> operator+(const Vec3<T>& vec) const {
+    inline Vec3<T> operator+(const Vec3<T>& vec) const noexcept {
         return {x + vec.x, y + vec.y, z + vec.z};
     }
 
-    inline Vec3<T> operator* (const T t) const{
+    inline Vec3<T> operator* (const T t) const noexcept {
         return {x * t, y * t, z * t};
     }
 
-    inline T dot(const Vec3<T>& vec) const {
+    inline T dot(const Vec3<T>& vec) const noexcept {
         return vec.x * x + vec.y * y + vec.z * z;
     }
 
-    inline Vec3<T> cross(const Vec3<T>& vec) const {
+    inline Vec3<T> cross(const Vec3<T>& vec) const noexcept {
         return {
             y * vec.z - z * vec.y,
             z * vec.x - x * vec.z,
@@ -84,6 +103,108 @@ template<typename T> struct Vec3{
 
 };
 
+#ifdef RAYTRACER_X86
+template<> inline Vec3<float> Vec3<float>::norm() const noexcept {
+    //Same rounding as the generic version: scalar sum of squares, correctly rounded sqrt and division.
+    __m128 len = _mm_sqrt_ss(_mm_set_ss(x*x + y*y + z*z));
+    __m128 positive = _mm_cmpgt_ss(len, _mm_setzero_ps());
+    len = _mm_or_ps(_mm_and_ps(positive, len), _mm_andnot_ps(positive, _mm_set_ss(INFINITY)));
+    float r[4];
+    _mm_storeu_ps(r, _mm_div_ps(_mm_setr_ps(x, y, z, 0), _mm_shuffle_ps(len, len, 0)));
+    return {r[0], r[1], r[2]};
+}
+#endif
+
+/**
+ * @brief Four floats processed at once (one SSE register on x86, an array otherwise). Operations round exactly like
+ * the same scalar operations.
+ */
+struct Float4 {
+#ifdef RAYTRACER_X86
+    __m128 v;
+
+    static inline Float4 splat(float f) noexcept { return {_mm_set1_ps(f)}; }
+    static inline Float4 set(float a, float b, float c, float d) noexcept { return {_mm_setr_ps(a, b, c, d)}; }
+    inline void store(float* dst) const noexcept { _mm_storeu_ps(dst, v); }
+
+    inline Float4 operator+(const Float4& f) const noexcept { return {_mm_add_ps(v, f.v)}; }
+    inline Float4 operator-(const Float4& f) const noexcept { return {_mm_sub_ps(v, f.v)}; }
+    inline Float4 operator*(const Float4& f) const noexcept { return {_mm_mul_ps(v, f.v)}; }
+    inline Float4 operator/(const Float4& f) const noexcept { return {_mm_div_ps(v, f.v)}; }
+    inline Float4 sqrt() const noexcept { return {_mm_sqrt_ps(v)}; }
+    /**
+     * @brief Per lane: f if mask lane is set, else this. Masks are results of compare operations.
+     */
+    inline Float4 select(const Float4& mask, const Float4& f) const noexcept {
+        return {_mm_or_ps(_mm_and_ps(mask.v, f.v), _mm_andnot_ps(mask.v, v))};
+    }
+    inline Float4 greater(const Float4& f) const noexcept { return {_mm_cmpgt_ps(v, f.v)}; }
+    inline Float4 less(const Float4& f) const noexcept { return {_mm_cmplt_ps(v, f.v)}; }
+    inline Float4 less_equal(const Float4& f) const noexcept { return {_mm_cmple_ps(v, f.v)}; }
+    /**
+     * @brief Get lanes of a mask as bits.
+     * @return uint32_t bit i is set if lane i is set.
+     */
+    inline uint32_t bits() const noexcept { return (uint32_t)_mm_movemask_ps(v); }
+#else
+    float v[4];
+
+    static inline Float4 splat(float f) noexcept { return {{f, f, f, f}}; }
+    static inline Float4 set(float a, float b, float c, float d) noexcept { return {{a, b, c, d}}; }
+    inline void store(float* dst) const noexcept { for(int i = 0; i < 4; i++) dst[i] = v[i]; }
+
+    template<typename F> inline Float4 apply(const Float4& f, F op) const noexcept {
+        return {{op(v[0], f.v[0]), op(v[1], f.v[1]), op(v[2], f.v[2]), op(v[3], f.v[3])}};
+    }
+    //Masks hold -1 (all bits set) or 0 per lane.
+    static inline float mask(bool b) noexcept { return b ? -1.0f : 0.0f; }
+
+    inline Float4 operator+(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return a + b; }); }
+    inline Float4 operator-(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return a - b; }); }
+    inline Float4 operator*(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return a * b; }); }
+    inline Float4 operator/(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return a / b; }); }
+    inline Float4 sqrt() const noexcept { return {{std::sqrt(v[0]), std::sqrt(v[1]), std::sqrt(v[2]), std::sqrt(v[3])}}; }
+    inline Float4 select(const Float4& m, const Float4& f) const noexcept {
+        return {{m.v[0] ? f.v[0] : v[0], m.v[1] ? f.v[1] : v[1], m.v[2] ? f.v[2] : v[2], m.v[3] ? f.v[3] : v[3]}};
+    }
+    inline Float4 greater(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return mask(a > b); }); }
+    inline Float4 less(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return mask(a < b); }); }
+    inline Float4 less_equal(const Float4& f) const noexcept { return apply(f, [](float a, float b){ return mask(a <= b); }); }
+    inline uint32_t bits() const noexcept {
+        return (v[0] != 0) | (v[1] != 0) << 1 | (v[2] != 0) << 2 | (v[3] != 0) << 3;
+    }
+#endif
+};
+
+/**
+ * @brief Four Vec3<float> as structure of arrays. Same operations and rounding as Vec3<float>, four lanes at once.
+ */
+struct Vec3x4 {
+    Float4 x, y, z;
+
+    static inline Vec3x4 splat(const Vec3<float>& v) noexcept { return {Float4::splat(v.x), Float4::splat(v.y), Float4::splat(v.z)}; }
+    static inline Vec3x4 set(const Vec3<float>& a, const Vec3<float>& b, const Vec3<float>& c, const Vec3<float>& d) noexcept {
+        return {Float4::set(a.x, b.x, c.x, d.x), Float4::set(a.y, b.y, c.y, d.y), Float4::set(a.z, b.z, c.z, d.z)};
+    }
+
+    inline Vec3x4 operator+(const Vec3x4& v) const noexcept { return {x + v.x, y + v.y, z + v.z}; }
+    inline Vec3x4 operator-(const Vec3x4& v) const noexcept { return {x - v.x, y - v.y, z - v.z}; }
+    inline Vec3x4 operator*(const Float4& f) const noexcept { return {x * f, y * f, z * f}; }
+
+    inline Float4 dot(const Vec3x4& v) const noexcept { return v.x * x + v.y * y + v.z * z; }
+    inline Vec3x4 cross(const Vec3x4& v) const noexcept {
+        return {y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x};
+    }
+    inline Float4 length() const noexcept { return (x * x + y * y + z * z).sqrt(); }
+    /**
+     * @brief Normalize all lanes (see Vec3::norm(), zero vectors stay zero). Branch-free.
+     */
+    inline Vec3x4 norm() const noexcept {
+        Float4 len = length();
+        len = Float4::splat(INFINITY).select(len.greater(Float4::splat(0)), len);
+        return {x / len, y / len, z / len};
+    }
+};
 
 template<typename T> struct Vec2{
     T x, y;
@@ -116,7 +237,7 @@ public:
     inline const T* data()      noexcept { return m_data; } 
 
     inline T& operator()(const size_t row, const size_t column) const {
-        return m_data[column + row * m_rows];
+        return m_data[column + row * m_colums];
         //            ^column     ^row
     }
 
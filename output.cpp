@@ -0,0 +1,124 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "output.h"
+#include "simd.h"
+#include <cstring>
+
+#ifdef RAYTRACER_X86
+#include <emmintrin.h>
+#endif
+
+void convert_to_8bit(const Color* src, uint8_t* dst, size_t count){
+    static_assert(sizeof(Color) == 4 * sizeof(float), "Color must consist of 4 packed floats (r, g, b, padding).");
+    size_t i = 0;
+#ifdef RAYTRACER_X86
+    const __m128 scale = _mm_set1_ps(255.0f);
+    alignas(16) uint8_t packed[16];
+    for(; i + 4 <= count; i += 4){
+        //Truncate like (int)(c * 255), then clamp by saturating packs: int32 -> int16 -> uint8.
+        __m128i a = _mm_cvttps_epi32(_mm_mul_ps(src[i].load(), scale));
+        __m128i b = _mm_cvttps_epi32(_mm_mul_ps(src[i + 1].load(), scale));
+        __m128i c = _mm_cvttps_epi32(_mm_mul_ps(src[i + 2].load(), scale));
+        __m128i d = _mm_cvttps_epi32(_mm_mul_ps(src[i + 3].load(), scale));
+        _mm_store_si128((__m128i*)packed, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        //Drop padding bytes.
+        for(size_t j = 0; j < 4; j++) std::memcpy(dst + (i + j) * 3, packed + j * 4, 3);
+    }
+#endif
+    for(; i < count; i++){
+        const float channels[3] = {src[i].r, src[i].g, src[i].b};
+        for(size_t c = 0; c < 3; c++){
+            float v = channels[c] * 255.0f;
+            dst[i * 3 + c] = !(v > 0) ? 0 : (v >= 255 ? 255 : (uint8_t)(int)v);
+        }
+    }
+}
+
+/**
+ * @brief Seek to 64-bit file offset (long is 32 bit on Windows).
+ */
+static bool seek(std::FILE* file, uint64_t offset){
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+ImageWriter::~ImageWriter(){
+    if(m_file) std::fclose(m_file);
+}
+
+void ImageWriter::begin(const char* dest, size_t width, size_t height){
+    if(m_file) throw "Writer is already in use.";
+    m_file = std::fopen(dest, "wb");
+    if(!m_file) throw "Cannot open file.";
+    std::setvbuf(m_file, nullptr, _IOFBF, buffer_size);
+    m_width = width;
+    m_height = height;
+    m_row = 0;
+    write_header();
+}
+
+void ImageWriter::write_rows(const Color* pixels, size_t rows){
+    if(!m_file) throw "Writer has not been started.";
+    if(m_row + rows > m_height) throw "Too many rows written to image.";
+    encode(pixels, rows);
+    m_row += rows;
+}
+
+void ImageWriter::finish(){
+    if(!m_file) throw "Writer has not been started.";
+    if(m_row != m_height) throw "Image has not been written completely.";
+    bool failed = std::fflush(m_file) != 0 || std::ferror(m_file);
+    std::fclose(m_file);
+    m_file = nullptr;
+    if(failed) throw "Cannot write file.";
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::create(const char* dest){
+    size_t length = std::strlen(dest);
+    if(length >= 4 && std::strcmp(dest + length - 4, ".pfm") == 0)
+        return std::unique_ptr<ImageWriter>(new PFMWriter());
+    return std::unique_ptr<ImageWriter>(new PPMWriter());
+}
+
+void PPMWriter::write_header(){
+    //Basic Header data for binary .ppm image files.
+    std::fprintf(m_file, "P6\n%zu %zu\n255\n", m_width, m_height);
+    //                     ^mode ^width ^height ^color value
+}
+
+void PPMWriter::encode(const Color* pixels, size_t rows){
+    const size_t count = rows * m_width;
+    m_buffer.resize(count * 3);
+    convert_to_8bit(pixels, m_buffer.data(), count);
+    std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+}
+
+void PFMWriter::write_header(){
+    //Negative scale = little endian.
+    int written = std::fprintf(m_file, "PF\n%zu %zu\n-1.0\n", m_width, m_height);
+    if(written < 0) throw "Cannot write file.";
+    m_header_size = written;
+}
+
+void PFMWriter::encode(const Color* pixels, size_t rows){
+    //PFM stores rows bottom to top: the band ends up reversed at the offset of its last row.
+    const size_t row_bytes = m_width * 3 * sizeof(float);
+    m_buffer.resize(rows * row_bytes);
+    for(size_t r = 0; r < rows; r++){
+        uint8_t* row = m_buffer.data() + (rows - 1 - r) * row_bytes;
+        for(size_t x = 0; x < m_width; x++)
+            std::memcpy(row + x * 3 * sizeof(float), &pixels[r * m_width + x].r, 3 * sizeof(float));
+    }
+    //Assumes a little endian machine (all supported platforms).
+    uint64_t offset = m_header_size + (uint64_t)(m_height - m_row - rows) * row_bytes;
+    if(!seek(m_file, offset)) throw "Cannot write file.";
+    std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+}
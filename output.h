@@ -0,0 +1,109 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "raytracer.h"
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+/**
+ * @brief Converts colors to 8-bit RGB triplets (vectorized). Channels are scaled by 255, truncated and clamped to [0, 255].
+ * This is the only place HDR colors are clamped for 8-bit output.
+ * @param src colors.
+ * @param dst destination (3 bytes per color).
+ * @param count amount of colors.
+ */
+void convert_to_8bit(const Color* src, uint8_t* dst, size_t count);
+
+/**
+ * @brief Writes images to files. Rows are passed top to bottom in bands, so images don't have to be in memory at once.
+ */
+class ImageWriter {
+protected:
+    /**
+     * @brief Output file.
+     */
+    std::FILE*              m_file      {nullptr};
+    size_t                  m_width     {0};
+    size_t                  m_height    {0};
+    /**
+     * @brief Amount of rows written so far.
+     */
+    size_t                  m_row       {0};
+    /**
+     * @brief Encoded data of the current band.
+     */
+    std::vector<uint8_t>    m_buffer;
+
+    /**
+     * @brief Write file header.
+     */
+    virtual void write_header() = 0;
+    /**
+     * @brief Encode and write rows [m_row, m_row + rows).
+     * @param pixels row-major pixels of the rows.
+     * @param rows amount of rows.
+     */
+    virtual void encode(const Color* pixels, size_t rows) = 0;
+public:
+    /**
+     * @brief Size of the stdio buffer of the output file.
+     */
+    static constexpr size_t buffer_size {1 << 20};
+
+    virtual ~ImageWriter();
+
+    /**
+     * @brief Create file and write header.
+     * @param dest file path (file will be created or overwritten).
+     * @param width width of image.
+     * @param height height of image.
+     */
+    void begin(const char* dest, size_t width, size_t height);
+    /**
+     * @brief Write next rows of image.
+     * @param pixels row-major pixels (rows * width colors).
+     * @param rows amount of rows.
+     */
+    void write_rows(const Color* pixels, size_t rows);
+    /**
+     * @brief Flush and close file. All rows must have been written.
+     */
+    void finish();
+
+    /**
+     * @brief Create writer matching the file extension: .pfm = PFM (float HDR), everything else = binary PPM (P6).
+     * @param dest file path.
+     * @return std::unique_ptr<ImageWriter> writer.
+     */
+    static std::unique_ptr<ImageWriter> create(const char* dest);
+};
+
+/**
+ * @brief Binary PPM (P6) with 8 bits per channel.
+ */
+class PPMWriter : public ImageWriter {
+protected:
+    virtual void write_header() override;
+    virtual void encode(const Color* pixels, size_t rows) override;
+};
+
+/**
+ * @brief Portable float map (PF) with 32-bit float channels (HDR). Rows are stored bottom to top,
+ * so each band is written at its final position in the file.
+ */
+class PFMWriter : public ImageWriter {
+protected:
+    /**
+     * @brief Size of header in bytes.
+     */
+    uint64_t m_header_size {0};
+    virtual void write_header() override;
+    virtual void encode(const Color* pixels, size_t rows) override;
+};
@@ -0,0 +1,34 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "primitives.h"
+
+void PrimitiveTraits<Sphere>::build(Data& data, const std::vector<Sphere*>& objects){
+    data.resize(objects.size());
+    for(size_t i = 0; i < objects.size(); i++) data.set(i, objects[i]->pos, objects[i]->radius);
+}
+
+void PrimitiveTraits<Sphere>::intersect(const Data& data, const std::vector<Sphere*>& objects, Ray& ray){
+    RenderStatistics* statistics = RenderStatistics::current;
+    float t_hit[32];
+    for(size_t first = 0; first < objects.size(); first += 32){
+        size_t count = std::min<size_t>(32, objects.size() - first);
+        uint32_t hits = intersect_spheres(data, first, count, ray.m_start, ray.m_dir, ray.m_min_distance, ray.m_closest_distance, t_hit);
+        if(statistics){
+            statistics->intersection_tests += count;
+            statistics->intersection_hits += count_bits(hits);
+        }
+        while(hits){
+            uint32_t lane = count_trailing_zeros(hits);
+            hits &= hits - 1;
+            Sphere* sphere = objects[first + lane];
+            if(sphere->m_visible && sphere != ray.m_ignore)
+                ray.intersection({ray.m_start + ray.m_dir * t_hit[lane], sphere}, t_hit[lane]);
+        }
+        if(ray.done()) return;
+    }
+}
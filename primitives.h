@@ -0,0 +1,148 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "raytracer.h"
+#include "simd.h"
+#include <vector>
+#include <tuple>
+#include <typeinfo>
+
+/**
+ * @brief Storage and batch intersection of one primitive type. Specialize for every type of PrimitiveStore.
+ * A specialization provides a Data type holding the geometry of all objects of the type contiguously and
+ * static void build(Data&, const std::vector<T*>&) and static void intersect(const Data&, const std::vector<T*>&, Ray&).
+ */
+template<typename T>
+struct PrimitiveTraits;
+
+/**
+ * @brief Spheres are tested by the SIMD kernel, 32 at a time.
+ */
+template<>
+struct PrimitiveTraits<Sphere> {
+    using Data = SphereSoA;
+    static void build(Data& data, const std::vector<Sphere*>& objects);
+    static void intersect(const Data& data, const std::vector<Sphere*>& objects, Ray& ray);
+};
+
+/**
+ * @brief All objects of one primitive type and their geometry.
+ */
+template<typename T>
+struct PrimitiveArray {
+    std::vector<T*>                     objects;
+    typename PrimitiveTraits<T>::Data   data;
+};
+
+/**
+ * @brief Objects of a scene sorted by type. Objects of exactly one of Types are stored in one array per type and are
+ * tested without virtual calls, one batch per type. All other objects (e.g. user-defined Renderables) are adapted
+ * through the virtual Renderable interface. Snapshot of a scene: rebuild after objects were added, removed or updated.
+ * @tparam Types closed set of primitive types. Each needs a PrimitiveTraits specialization.
+ */
+template<typename... Types>
+class PrimitiveSet {
+protected:
+    std::tuple<PrimitiveArray<Types>...>    m_arrays;
+    /**
+     * @brief Objects of other types.
+     */
+    std::vector<Renderable*>                m_generic;
+    /**
+     * @brief SceneData::m_generation the set was built for.
+     */
+    size_t                                  m_generation {0};
+    size_t                                  m_size {0};
+
+    template<typename T>
+    bool sort(Renderable* object){
+        //Only exact types: derived types may override intersect().
+        if(typeid(*object) != typeid(T)) return false;
+        std::get<PrimitiveArray<T>>(m_arrays).objects.push_back(static_cast<T*>(object));
+        return true;
+    }
+
+    template<typename T>
+    void intersect_batch(Ray& ray) const {
+        if(ray.done()) return;
+        const PrimitiveArray<T>& array = std::get<PrimitiveArray<T>>(m_arrays);
+        PrimitiveTraits<T>::intersect(array.data, array.objects, ray);
+    }
+
+public:
+    /**
+     * @brief Sorts objects by type and copies their geometry.
+     * @param objects objects of scene.
+     * @param generation SceneData::m_generation of objects.
+     */
+    PrimitiveSet(const std::vector<Renderable*>& objects, size_t generation) : m_generation(generation), m_size(objects.size()) {
+        for(Renderable* object : objects){
+            bool sorted = false;
+            using expand = bool[];
+            (void)expand{false, (sorted = sorted || sort<Types>(object))...};
+            if(!sorted) m_generic.push_back(object);
+        }
+        using expand = int[];
+        (void)expand{0, (PrimitiveTraits<Types>::build(std::get<PrimitiveArray<Types>>(m_arrays).data,
+                                                       std::get<PrimitiveArray<Types>>(m_arrays).objects), 0)...};
+    }
+    PrimitiveSet(const PrimitiveSet&) = delete;
+    PrimitiveSet& operator=(const PrimitiveSet&) = delete;
+
+    /**
+     * @brief Checks ray for intersections with all visible objects, respecting its query interval and mode.
+     * @param ray Ray.
+     */
+    void intersect(Ray& ray) const {
+        using expand = int[];
+        (void)expand{0, (intersect_batch<Types>(ray), 0)...};
+        RenderStatistics* statistics = RenderStatistics::current;
+        for(Renderable* object : m_generic){
+            if(ray.done()) return;
+            if(object->m_visible && object != ray.m_ignore){
+                bool hit = object->intersect(ray);
+                if(statistics){
+                    statistics->intersection_tests++;
+                    statistics->intersection_hits += hit;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Get objects of a primitive type.
+     * @tparam T one of Types.
+     * @return const std::vector<T*>& objects.
+     */
+    template<typename T>
+    inline const std::vector<T*>& objects() const noexcept { return std::get<PrimitiveArray<T>>(m_arrays).objects; }
+    /**
+     * @brief Get amount of objects in set.
+     * @return size_t amount of objects.
+     */
+    inline size_t size() const noexcept { return m_size; }
+    /**
+     * @brief Get objects not of one of Types.
+     * @return const std::vector<Renderable*>& objects.
+     */
+    inline const std::vector<Renderable*>& generic() const noexcept { return m_generic; }
+    /**
+     * @brief Get generation of scene the set was built for.
+     * @return size_t SceneData::m_generation.
+     */
+    inline size_t generation() const noexcept { return m_generation; }
+};
+
+/**
+ * @brief Primitive types of the renderer. To add a type, list it here and specialize PrimitiveTraits for it.
+ * Only tested by rays if the scene is rendered without acceleration structure (the BVH keeps its own sphere data).
+ */
+class PrimitiveStore : public PrimitiveSet<Sphere> {
+public:
+    using PrimitiveSet::PrimitiveSet;
+};
@@ -7,25 +7,222 @@
 
 #include "processing.h"
 
+thread_pool::thread_pool(size_t thread_count)
+: m_queue{4096}
+{
+    if(thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    if(thread_count == 0) thread_count = 1;
+    m_workers.reserve(thread_count);
+    for(size_t i = 0; i < thread_count; i++) m_workers.emplace_back(&thread_pool::worker, this);
+}
+
+thread_pool::~thread_pool(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    for(std::thread& th : m_workers) th.join();
+}
+
+thread_pool& thread_pool::global(){
+    static thread_pool pool(process_organizer::max_process_count);
+    return pool;
+}
+
+void thread_pool::submit(task t){
+    //Count before the task becomes visible, so a worker popping it right away can't decrement below 0.
+    m_queued.fetch_add(1);
+    if(!m_queue.try_push(t)){
+        //Queue is full: don't wait for a free slot.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_overflow.push_back(std::move(t));
+        m_overflowed.fetch_add(1);
+    }
+    if(m_sleeping.load() > 0){
+        //Lock so the notification can't slip in between predicate check and wait of a worker.
+        { std::lock_guard<std::mutex> lock(m_mutex); }
+        m_wakeup.notify_one();
+    }
+}
+
+bool thread_pool::run_pending_task(){
+    task t;
+    if(!m_queue.try_pop(t)){
+        if(m_overflowed.load() == 0) return false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_overflow.empty()) return false;
+        t = std::move(m_overflow.front());
+        m_overflow.pop_front();
+        m_overflowed.fetch_sub(1);
+    }
+    m_queued.fetch_sub(1);
+    t();
+    return true;
+}
+
+void thread_pool::worker(){
+    while(true){
+        if(run_pending_task()) continue;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_sleeping.fetch_add(1);
+        m_wakeup.wait(lock, [this](){ return m_stop || m_queued.load() > 0; });
+        m_sleeping.fetch_sub(1);
+        if(m_stop && m_queued.load() == 0) return;
+    }
+}
+
+task_group::task_group(thread_pool& pool)
+: m_pool{pool}
+{}
+
+task_group::~task_group(){
+    join();
+}
+
+void task_group::run(std::function<void()> t){
+    m_pending.fetch_add(1);
+    m_pool.submit([this, t = std::move(t)](){
+        //Exceptions must not leave pool threads (std::terminate), they are handed to wait().
+        try {
+            if(!m_failed.load()) t();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!m_error) m_error = std::current_exception();
+            m_failed = true;
+        }
+        finish();
+    });
+}
+
+void task_group::finish(){
+    //Decrement under the lock: join() can only return (and the group be destroyed) after it has been released.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_pending.fetch_sub(1) == 1) m_done.notify_all();
+}
+
+void task_group::join(){
+    //Help with queued work first, so waiting inside a pool task can't starve the pool.
+    while(m_pending.load() > 0 && m_pool.run_pending_task());
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this](){ return m_pending.load() == 0; });
+}
+
+void task_group::wait(){
+    join();
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(error, m_error);
+        //Group may be reused.
+        m_failed = false;
+    }
+    if(error) std::rethrow_exception(error);
+}
+
 void process::start(){
     run();
-    process_organizer::current_process_count--;
     delete this;
+    process_organizer::finish();
 }
 
 process::process(){
-    while(process_organizer::current_process_count >= process_organizer::max_process_count);
     process_organizer::current_process_count++;
-    std::thread th(&process::start, this);
-    th.detach();
+}
+
+void process::submit(){
+    thread_pool::global().submit([this](){ start(); });
 }
 
 void process_organizer::wait() {
-    while (!all_finished());
+    std::unique_lock<std::mutex> lock(s_mutex);
+    s_finished.wait(lock, [](){ return all_finished(); });
+}
+
+void process_organizer::finish() {
+    if(current_process_count.fetch_sub(1) == 1){
+        std::lock_guard<std::mutex> lock(s_mutex);
+        s_finished.notify_all();
+    }
 }
 
 process::~process() {
 }
 
 size_t process_organizer::max_process_count = std::thread::hardware_concurrency();
-size_t process_organizer::current_process_count = 0;
\ No newline at end of file
+std::atomic<size_t> process_organizer::current_process_count {0};
+std::mutex process_organizer::s_mutex;
+std::condition_variable process_organizer::s_finished;
+
+work_stealing_scheduler::work_stealing_scheduler(size_t thread_count)
+: m_thread_count{thread_count}
+{
+    if(m_thread_count == 0) m_thread_count = thread_pool::global().thread_count() + 1;
+}
+
+static inline uint64_t pack_range(uint64_t begin, uint64_t end){
+    return begin | (end << 32);
+}
+
+bool work_stealing_scheduler::pop(item_range& range, size_t& item){
+    uint64_t bounds = range.bounds.load(std::memory_order_acquire);
+    while(true){
+        uint64_t begin = bounds & 0xFFFFFFFF;
+        uint64_t end = bounds >> 32;
+        if(begin >= end) return false;
+        if(range.bounds.compare_exchange_weak(bounds, pack_range(begin + 1, end), std::memory_order_acq_rel)){
+            item = begin;
+            return true;
+        }
+    }
+}
+
+bool work_stealing_scheduler::steal(std::vector<item_range>& ranges, size_t self){
+    const size_t count = ranges.size();
+    for(size_t i = 1; i < count; i++){
+        item_range& victim = ranges[(self + i) % count];
+        uint64_t bounds = victim.bounds.load(std::memory_order_acquire);
+        while(true){
+            uint64_t begin = bounds & 0xFFFFFFFF;
+            uint64_t end = bounds >> 32;
+            if(begin >= end) break;
+            //Take the back half, the victim keeps working on its front.
+            uint64_t split = end - (end - begin + 1) / 2;
+            if(victim.bounds.compare_exchange_weak(bounds, pack_range(begin, split), std::memory_order_acq_rel)){
+                //Own range is empty, so nobody else can modify it right now.
+                ranges[self].bounds.store(pack_range(split, end), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void work_stealing_scheduler::run(size_t item_count, const std::function<void(size_t, size_t)>& work){
+    if(item_count == 0) return;
+    if(item_count > 0xFFFFFFFF) throw "Too many work items for scheduler.";
+    const size_t workers = m_thread_count < item_count ? m_thread_count : item_count;
+
+    //Initial distribution: every worker gets a contiguous block of items.
+    std::vector<item_range> ranges(workers);
+    for(size_t w = 0; w < workers; w++){
+        size_t begin = item_count * w / workers;
+        size_t end = item_count * (w + 1) / workers;
+        ranges[w].bounds.store(pack_range(begin, end), std::memory_order_relaxed);
+    }
+
+    auto worker = [&](size_t self){
+        size_t item;
+        do {
+            while(pop(ranges[self], item)) work(item, self);
+        } while(steal(ranges, self));
+    };
+
+    //Workers that don't get a pool thread in time are covered by stealing.
+    task_group group;
+    for(size_t w = 1; w < workers; w++) group.run([&worker, w](){ worker(w); });
+    worker(0);
+    group.wait();
+}
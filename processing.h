@@ -5,7 +5,236 @@
 // \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
 //  https://github.com/danielmehlber                                     
 
+#pragma once
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <deque>
+#include <exception>
+
+/**
+ * @brief Bounded lock-free multi-producer/multi-consumer queue (ring buffer with per-cell sequence numbers).
+ * @tparam T element type (must be movable).
+ */
+template <typename T> class mpmc_queue {
+protected:
+    struct alignas(64) cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+    std::unique_ptr<cell[]>     m_cells;
+    const size_t                m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos {0};
+    alignas(64) std::atomic<size_t> m_dequeue_pos {0};
+public:
+    /**
+     * @brief Construct a new queue.
+     * @param capacity max amount of elements. Must be a power of 2.
+     */
+    mpmc_queue(size_t capacity);
+
+    /**
+     * @brief Push element to the back of the queue.
+     * @param t element.
+     * @return true element has been pushed.
+     * @return false queue is full, element has not been moved.
+     */
+    bool try_push(T& t);
+    /**
+     * @brief Pop element from the front of the queue.
+     * @param t popped element.
+     * @return true element has been popped.
+     * @return false queue is empty.
+     */
+    bool try_pop(T& t);
+};
+
+template <typename T> mpmc_queue<T>::mpmc_queue(size_t capacity)
+: m_cells{new cell[capacity]}, m_mask{capacity - 1}
+{
+    if(capacity < 2 || (capacity & (capacity - 1)) != 0) throw "Capacity of queue must be a power of 2.";
+    for(size_t i = 0; i < capacity; i++) m_cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template <typename T> bool mpmc_queue<T>::try_push(T& t){
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    while(true){
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0){
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if(diff < 0) return false;
+        else pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+    c->data = std::move(t);
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T> bool mpmc_queue<T>::try_pop(T& t){
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    while(true){
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0){
+            if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if(diff < 0) return false;
+        else pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    }
+    t = std::move(c->data);
+    c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Persistent worker threads executing submitted tasks from a lock-free queue.
+ * Idle workers block instead of spinning.
+ */
+class thread_pool {
+protected:
+    using task = std::function<void()>;
+    /**
+     * @brief Queued tasks.
+     */
+    mpmc_queue<task>            m_queue;
+    /**
+     * @brief Tasks that didn't fit into the queue. Guarded by m_mutex.
+     */
+    std::deque<task>            m_overflow;
+    /**
+     * @brief Amount of tasks in m_overflow.
+     */
+    std::atomic<size_t>         m_overflowed {0};
+    /**
+     * @brief Amount of queued tasks (may be briefly ahead of the queues themselves, never behind).
+     */
+    std::atomic<size_t>         m_queued    {0};
+    /**
+     * @brief Amount of workers waiting for tasks.
+     */
+    std::atomic<size_t>         m_sleeping  {0};
+    std::atomic<bool>           m_stop      {false};
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wakeup;
+    std::vector<std::thread>    m_workers;
+
+    /**
+     * @brief Main loop of each worker thread.
+     */
+    void worker();
+public:
+    /**
+     * @brief Construct a new pool and start its workers.
+     * @param thread_count amount of workers. 0 = amount of hardware threads.
+     */
+    thread_pool(size_t thread_count = 0);
+    /**
+     * @brief Finishes all queued tasks and stops workers.
+     */
+    ~thread_pool();
+    thread_pool(const thread_pool&) = delete;
+
+    /**
+     * @brief Pool shared by the whole program. Created on first use with process_organizer::max_process_count workers.
+     * @return thread_pool& global pool.
+     */
+    static thread_pool& global();
+
+    /**
+     * @brief Get amount of worker threads.
+     * @return size_t amount of workers.
+     */
+    inline size_t thread_count() const noexcept { return m_workers.size(); }
+
+    /**
+     * @brief Queue task for execution. Never blocks: if the lock-free queue is full, the task is put into an overflow list.
+     * @param t task.
+     */
+    void submit(task t);
+
+    /**
+     * @brief Queue callable and get a future of its result.
+     * @param f callable without arguments.
+     * @return std::future result of callable.
+     */
+    template <typename F> auto async(F&& f) -> std::future<decltype(f())>;
+
+    /**
+     * @brief Execute one queued task in the calling thread (used to help while waiting).
+     * @return true a task has been executed.
+     * @return false queue was empty.
+     */
+    bool run_pending_task();
+};
+
+template <typename F> auto thread_pool::async(F&& f) -> std::future<decltype(f())> {
+    auto packaged = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+    auto future = packaged->get_future();
+    submit([packaged](){ (*packaged)(); });
+    return future;
+}
+
+/**
+ * @brief Group of tasks running on a thread pool which can be joined. The first exception thrown by a task is
+ * rethrown by wait(), tasks which haven't started yet are skipped after it.
+ */
+class task_group {
+protected:
+    thread_pool&                m_pool;
+    std::atomic<size_t>         m_pending {0};
+    std::atomic<bool>           m_failed  {false};
+    /**
+     * @brief First exception thrown by a task. Guarded by m_mutex.
+     */
+    std::exception_ptr          m_error;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_done;
+
+    /**
+     * @brief Mark one task of group as finished.
+     */
+    void finish();
+    /**
+     * @brief Waits until all tasks of group are finished without rethrowing exceptions.
+     */
+    void join();
+public:
+    /**
+     * @brief Construct a new task group.
+     * @param pool pool executing the tasks.
+     */
+    task_group(thread_pool& pool = thread_pool::global());
+    /**
+     * @brief Waits for all tasks of the group. Exceptions of tasks are dropped if wait() hasn't been called.
+     */
+    ~task_group();
+    task_group(const task_group&) = delete;
+
+    /**
+     * @brief Run task as part of group.
+     * @param t task.
+     */
+    void run(std::function<void()> t);
+    /**
+     * @brief Waits until all tasks of group are finished. Helps executing queued tasks, then blocks.
+     * Rethrows the first exception thrown by a task. Afterwards the group can be used again.
+     */
+    void wait();
+    /**
+     * @brief Checks if a task of the group has thrown.
+     * @return true a task has thrown, remaining tasks are skipped.
+     */
+    inline bool failed() const noexcept { return m_failed.load(); }
+};
 
 /**
  * @brief Manages amount of running processes.
@@ -17,21 +246,28 @@ public:
      */ 
     static size_t max_process_count;
     /**
-     * @brief Current amount of running processes (always < max amount).
+     * @brief Current amount of running processes.
      */ 
-    static size_t current_process_count;
+    static std::atomic<size_t> current_process_count;
     /**
      * @brief Are all processes finished?
      */ 
     inline static bool all_finished() { return current_process_count == 0; };
     /**
-     * @brief Waits until all processes are finished (= until porcess count equals 0).
+     * @brief Waits until all processes are finished (= until porcess count equals 0). Blocks without spinning.
      */
     static void wait();
+    /**
+     * @brief Mark a process as finished and wake up waiting threads.
+     */
+    static void finish();
+protected:
+    static std::mutex              s_mutex;
+    static std::condition_variable s_finished;
 };
 
 /**
- * @brief virtual process managing a thread.
+ * @brief virtual process running as task of the global thread pool.
  */
 class process {
 protected:
@@ -43,10 +279,84 @@ protected:
      * @brief starts the process. 
      */
     void start();
-public:
     /**
-     * @brief Creates and starts new process inside thread.
+     * @brief Creates new process. It is submitted by create() once fully constructed.
      */ 
     process();
+    /**
+     * @brief Submits process to the global thread pool.
+     */
+    void submit();
+public:
     virtual ~process();
-};
\ No newline at end of file
+
+    /**
+     * @brief Creates new process and runs it on the global thread pool. The process deletes itself when finished.
+     * @tparam P process type.
+     * @param args constructor arguments of P.
+     */
+    template <typename P, typename... Args> static void create(Args&&... args);
+};
+
+template <typename P, typename... Args> void process::create(Args&&... args){
+    process* p = new P(std::forward<Args>(args)...);
+    //Submit only after construction of P has finished, otherwise run() could be called on an incomplete object.
+    p->submit();
+}
+
+/**
+ * @brief Distributes a range of indexed work items (e.g. image tiles) to worker threads.
+ * Every worker owns a contiguous part of the range and takes items from its front. Idle workers
+ * steal the back half of another worker's remaining items, so expensive items don't leave cores idle.
+ */
+class work_stealing_scheduler {
+protected:
+    /**
+     * @brief Remaining items of one worker, packed as [begin (low 32 bit), end (high 32 bit)).
+     * Padded to a cache line so workers don't share lines.
+     */
+    struct alignas(64) item_range {
+        std::atomic<uint64_t> bounds {0};
+    };
+    /**
+     * @brief Amount of workers used by run().
+     */
+    size_t m_thread_count;
+
+    /**
+     * @brief Take next item from the front of a range.
+     * @param range range of worker.
+     * @param item taken item.
+     * @return true an item was taken.
+     * @return false range is empty.
+     */
+    static bool pop(item_range& range, size_t& item);
+    /**
+     * @brief Steal the back half of another workers range and store it in own range.
+     * @param ranges all ranges.
+     * @param self index of stealing worker.
+     * @return true items were stolen.
+     * @return false all ranges are empty.
+     */
+    static bool steal(std::vector<item_range>& ranges, size_t self);
+public:
+    /**
+     * @brief Construct a new scheduler.
+     * @param thread_count amount of workers. 0 = amount of threads in global pool + calling thread.
+     */
+    work_stealing_scheduler(size_t thread_count = 0);
+
+    /**
+     * @brief Get amount of workers used by run().
+     * @return size_t amount of workers.
+     */
+    inline size_t thread_count() const noexcept { return m_thread_count; }
+
+    /**
+     * @brief Executes work for each item in [0, item_count) on the global thread pool and the calling thread.
+     * Returns when all items are done.
+     * @param item_count amount of items.
+     * @param work function called with (item, worker index).
+     */
+    void run(size_t item_count, const std::function<void(size_t, size_t)>& work);
+};
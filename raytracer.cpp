@@ -6,64 +6,769 @@
 //  https://github.com/danielmehlber                                     
 
 #include "raytracer.h"
+#include "acceleration.h"
+#include "primitives.h"
+#include "simd.h"
+#include "output.h"
+#include <vector>
+#include <cmath>
 
 
 
-Image::Image(const size_t width, const size_t height)
-: Matrix<Color>(width, height)
-{}
+/**
+ * @brief Round up to full blocks of tiled layout.
+ */
+static inline size_t padded(size_t size, ImageLayout layout){
+    if(layout == ImageLayout::linear) return size;
+    return (size + Image::block_size - 1) & ~(Image::block_size - 1);
+}
+
+Image::Image(const size_t width, const size_t height, ImageLayout layout)
+: Matrix<Color>(padded(height, layout), padded(width, layout)),
+  m_width{width}, m_height{height}, m_layout{layout}, m_stride{padded(width, layout)}
+{
+    const bool tiled = layout == ImageLayout::tiled;
+    m_low = tiled ? block_size - 1 : 0;
+    m_high = ~m_low;
+    m_shift = tiled ? block_shift : 0;
+}
+
+void Image::read_rows(size_t first_row, size_t count, Color* dst) const {
+    if(first_row + count > m_height) throw "Cannot read rows outside of image.";
+    if(m_layout == ImageLayout::linear){
+        std::copy(m_data + first_row * m_width, m_data + (first_row + count) * m_width, dst);
+        return;
+    }
+    //Rows of a block are contiguous: copy block_size pixels at once.
+    for(size_t y = first_row; y < first_row + count; y++){
+        Color* row = dst + (y - first_row) * m_width;
+        for(size_t x = 0; x < m_width; x += block_size)
+            std::copy_n(&operator()(x, y), std::min(block_size, m_width - x), row + x);
+    }
+}
 
 void Image::write(const char * dest) const {
-    std::ofstream file(dest);
-    if(!file || file.bad()) throw "Cannot open file.";
-    //Basic Header data for .ppm image files.
-    file << "P3\n" << width() << "\n" << height() << "\n" << "255\n"; 
-    //Data    ^mode     ^width             ^height             ^color value
-    for(size_t y = 0; y < height(); y++){
-        for(size_t x = 0; x < width(); x++)
-            file << operator()(x, y);
+    ProfileZone zone("image write", "output");
+    auto writer = ImageWriter::create(dest);
+    writer->begin(dest, width(), height());
+    //Collect rows in bands (in linear order) and pass them to the writer.
+    const size_t band = 64;
+    std::vector<Color> rows(band * width());
+    for(size_t y = 0; y < height(); y += band){
+        size_t count = std::min(band, height() - y);
+        read_rows(y, count, rows.data());
+        writer->write_rows(rows.data(), count);
+    }
+    writer->finish();
+}
+
+View Raytracer::prepare_frame(size_t width, size_t height, bool build){
+    m_width = width;
+    m_height = height;
+
+    //View vectors and camera basis of frame.
+    View view(camera, width, height);
+
+    //Build acceleration structure.
+    if(use_acceleration && !build && scene.m_bvh && scene.m_bvh_generation == scene.m_generation){
+        //Keep acceleration structure.
+    } else if(use_acceleration){
+        ProfileZone zone("acceleration build", "setup");
+        Clock build_clock;
+        scene.build_acceleration(acceleration_cache.empty() ? nullptr : acceleration_cache.c_str());
+        auto build_time = build_clock.stop();
+        std::cout << (scene.m_bvh->cached() ? "BVH load time: " : "BVH build time: ") << (build_time/1000000) << "ms ("
+                  << scene.m_bvh->node_count() << " nodes)" << std::endl;
+    } else {
+        scene.m_bvh.reset();
+        if(!scene.m_primitives || scene.m_primitives->generation() != scene.m_generation) scene.build_primitives();
+    }
+    scene.cull(camera, view);
+
+    return view;
+}
+
+/**
+ * @brief Compares camera settings that affect primary rays.
+ */
+static bool same_camera(const Camera& a, const Camera& b){
+    auto same = [](const Vec3<float>& u, const Vec3<float>& v){ return u.x == v.x && u.y == v.y && u.z == v.z; };
+    return same(a.pos, b.pos) && same(a.rot, b.rot) && same(a.scale, b.scale) && a.max_ray_bounces == b.max_ray_bounces
+        && a.view_plane.x == b.view_plane.x && a.view_plane.y == b.view_plane.y && a.distance == b.distance
+        && a.projection == b.projection;
+}
+
+thread_local RenderStatistics* RenderStatistics::current = nullptr;
+
+void RenderStatistics::merge(const RenderStatistics& other) noexcept {
+    primary_rays += other.primary_rays;
+    reflection_rays += other.reflection_rays;
+    shadow_rays += other.shadow_rays;
+    intersection_tests += other.intersection_tests;
+    intersection_hits += other.intersection_hits;
+    for(size_t i = 0; i < max_depth; i++) bounce_histogram[i] += other.bounce_histogram[i];
+    intersection_time += other.intersection_time;
+    materialization_time += other.materialization_time;
+}
+
+void RenderStatistics::write_json(std::ostream& stream) const {
+    stream << "{\n  \"primary_rays\": " << primary_rays
+           << ",\n  \"reflection_rays\": " << reflection_rays
+           << ",\n  \"shadow_rays\": " << shadow_rays
+           << ",\n  \"intersection_tests\": " << intersection_tests
+           << ",\n  \"intersection_hits\": " << intersection_hits
+           << ",\n  \"bounce_histogram\": [";
+    for(size_t i = 0; i < max_depth; i++) stream << (i ? ", " : "") << bounce_histogram[i];
+    stream << "],\n  \"primary_candidates\": " << primary_candidates
+           << ",\n  \"culled_objects\": " << culled_objects
+           << ",\n  \"intersection_time_ns\": " << intersection_time
+           << ",\n  \"materialization_time_ns\": " << materialization_time
+           << ",\n  \"render_time_ns\": " << render_time << "\n}\n";
+}
+
+/**
+ * @brief Lets the calling thread count into statistics while in scope.
+ */
+struct StatisticsScope {
+    StatisticsScope(RenderStatistics* statistics) noexcept { RenderStatistics::current = statistics; }
+    ~StatisticsScope() { RenderStatistics::current = nullptr; }
+};
+
+/**
+ * @brief Adds the intersection tests, reflection rays and cycles of the calling thread while in scope to a pixel.
+ */
+struct CostProbe {
+    PixelCost*          cost;
+    RenderStatistics*   statistics;
+    uint64_t            tests, reflections, cycles;
+
+    CostProbe(PixelCost* _cost) noexcept
+    : cost{_cost}, statistics{RenderStatistics::current}
+    {
+        if(!cost || !statistics) return;
+        tests = statistics->intersection_tests;
+        reflections = statistics->reflection_rays;
+        cycles = cycle_count();
+    }
+    ~CostProbe(){
+        if(!cost || !statistics) return;
+        cost->cycles += cycle_count() - cycles;
+        cost->intersection_tests += (uint32_t)(statistics->intersection_tests - tests);
+        cost->reflection_rays += (uint32_t)(statistics->reflection_rays - reflections);
     }
-    file.flush();
+};
+
+RenderStatistics* Raytracer::worker_statistics(size_t worker) noexcept {
+    return worker < m_worker_statistics.size() ? &m_worker_statistics[worker] : nullptr;
 }
 
 void Raytracer::render(){
+    ProfileZone zone("render", "frame");
     Clock render_clock;
     const size_t width = m_img->width();
     const size_t height = m_img->height();
 
-    //Empty view of scene. 
-    View view;
+    //Find out what has to be done: Trace primary rays again, only shade again or nothing.
+    uint32_t dirty = scene.m_dirty;
+    if(!m_frame.valid || m_gbuffer.size() != width * height || !same_camera(m_frame.camera, camera)
+        || m_frame.max_samples != max_samples || m_frame.contrast_threshold != contrast_threshold)
+        dirty |= dirty_camera;
+    if(dirty == dirty_none){
+        std::cout << "Scene unchanged, image kept." << std::endl;
+        display(m_img);
+        return;
+    }
+    //Cost of pixels is only known if all of them are traced.
+    if(record_cost) dirty |= dirty_camera;
+    const bool retrace = dirty & (dirty_camera | dirty_geometry);
+    scene.m_dirty = dirty_none;
+    m_frame.valid = true;
+    m_frame.camera = camera;
+    m_frame.max_samples = max_samples;
+    m_frame.contrast_threshold = contrast_threshold;
 
-    //Calculate view plane (=perspective) of view.
-    view.ul = {camera.distance, -camera.view_plane.x / 2, camera.view_plane.y / 2};
-    view.ll = {camera.distance, view.ul.y, -camera.view_plane.y / 2};
-    view.ur = {camera.distance, camera.view_plane.x / 2, view.ul.z};
-    view.lr = {camera.distance, view.ur.y, view.ll.z};
+    View view = prepare_frame(width, height, dirty & dirty_geometry);
+    work_stealing_scheduler scheduler(thread_count);
+    m_worker_statistics.assign(collect_statistics || record_cost ? scheduler.thread_count() : 0, RenderStatistics());
+    if(record_cost) m_pixel_cost.assign(width * height, PixelCost());
+    else/********/  m_pixel_cost.clear();
+    for(RenderStatistics& statistics : m_worker_statistics) statistics.max_bounces = camera.max_ray_bounces;
+    //Merge statistics of workers. Counting into per-worker statistics needs no synchronization.
+    auto finish_statistics = [&](double time){
+        m_statistics = RenderStatistics();
+        m_statistics.max_bounces = camera.max_ray_bounces;
+        for(const RenderStatistics& statistics : m_worker_statistics) m_statistics.merge(statistics);
+        m_statistics.render_time = time;
+        m_statistics.culled_objects = scene.m_culled_objects;
+        m_statistics.primary_candidates = scene.m_render_list.size() - scene.m_culled_objects;
+        m_worker_statistics.clear();
+        if(!collect_statistics) return;
+        std::cout << "Rays: " << m_statistics.primary_rays << " primary, " << m_statistics.reflection_rays << " reflection, "
+                  << m_statistics.shadow_rays << " shadow; intersection tests: " << m_statistics.intersection_tests
+                  << " (" << m_statistics.intersection_hits << " hits)";
+        if(m_statistics.culled_objects)
+            std::cout << "; culled objects: " << m_statistics.culled_objects << " of " << scene.m_render_list.size();
+        std::cout << std::endl;
+        if(statistics_file.empty()) return;
+        std::ofstream file(statistics_file);
+        if(!file) throw "Cannot open statistics file.";
+        m_statistics.write_json(file);
+    };
 
-    //Rotate Camera: Rotate view.
-    rotate(view.ul, camera.rot.x, camera.rot.y, camera.rot.z); //    ul ------------ ur
-    rotate(view.ll, camera.rot.x, camera.rot.y, camera.rot.z); //    |               |
-    rotate(view.ur, camera.rot.x, camera.rot.y, camera.rot.z); //    |               |
-    rotate(view.lr, camera.rot.x, camera.rot.y, camera.rot.z); //    ll ------------ lr
+    if(!retrace){
+        //Only lights or materials changed => Materialization stage only.
+        shade(view);
+        m_sampling = supersample(view);
+        auto time = render_clock.stop();
+        std::cout << "Re-shading time: " << (time/1000000) << "ms" << std::endl;
+        finish_statistics(time);
+        display(m_img);
+        return;
+    }
+    m_gbuffer.assign(width * height, GBufferEntry());
 
-    //Iterate through pixels and calculate their color => Rendering.
-    for(size_t y = 0; y < height; y++)
-        for(size_t x = 0; x < width; x++){
-            //For each pixel:
-            //1. Calculate ray direction vector from view plane and current pixel position.
-            Vec3<float> _ray_direction_x_only   = view.ul + (view.ur - view.ul) * ((float)x / (float)width);
-            Vec3<float> ray_direction           = _ray_direction_x_only + ((view.lr - view.ur) * ((float)y / (float)height));
-
-            //2. Cast ray from camera position, generated direction and bounce limit.
-            Ray raycast(camera.max_ray_bounces, camera.pos, ray_direction.norm());
-            m_img->operator()(x, y) = raycast.fire(scene);
-            //                ^Pixel                ^Visible data
-        }
+    //Split image into tiles and render them in parallel => Rendering.
+    const bool wavefront = !record_cost && wavefront_tile;
+    const size_t tile = wavefront ? wavefront_tile : (tile_size ? tile_size : 1);
+    const size_t tiles_x = (width + tile - 1) / tile;
+    const size_t tiles_y = (height + tile - 1) / tile;
+    const bool packets = !record_cost && (packet_size == 4 || packet_size == 8) && scene.m_bvh && scene.m_bvh->supports_packets();
+    scheduler.run(tiles_x * tiles_y, [&](size_t index, size_t worker){
+        ProfileZone tile_zone("tile", "render", index);
+        StatisticsScope scope(worker_statistics(worker));
+        size_t x0 = (index % tiles_x) * tile;
+        size_t y0 = (index / tiles_x) * tile;
+        if(wavefront)   render_tile_wavefront(view, *m_img, 0, x0, y0, std::min(x0 + tile, width), std::min(y0 + tile, height), m_gbuffer.data());
+        else if(packets)render_tile_packets(view, *m_img, 0, x0, y0, std::min(x0 + tile, width), std::min(y0 + tile, height), m_gbuffer.data());
+        else/******/    render_tile(view, *m_img, 0, x0, y0, std::min(x0 + tile, width), std::min(y0 + tile, height), m_gbuffer.data(),
+                                    m_pixel_cost.empty() ? nullptr : m_pixel_cost.data());
+    });
+    //Anti-aliasing => Supersampling of edges.
+    m_sampling = supersample(view);
     auto time = render_clock.stop();
     std::cout << "Elapsed time: " << (int)time << "ns = " << (time/1000000) << "ms" << std::endl;
+    std::cout << "Primary rays/s: " << m_sampling.samples / (time / 1000000000) << std::endl;
+    if(max_samples > 1)
+        std::cout << "Samples: " << m_sampling.samples << " (" << m_sampling.refined_pixels << " pixels refined), uniform: "
+                  << m_sampling.uniform_samples << std::endl;
+    finish_statistics(time);
     display(m_img);
 }
 
+ProgressiveResult Raytracer::render_progressive(double budget, size_t coarse_step){
+    ProfileZone zone("progressive render", "frame");
+    Clock render_clock;
+    const double deadline = budget * 1000000;
+    const size_t width = m_img->width();
+    const size_t height = m_img->height();
+    View view = prepare_frame(width, height, scene.m_dirty & dirty_geometry);
+    //Image does not match the G-buffer anymore, so the next render() traces all pixels again anyway.
+    m_frame.valid = false;
+    scene.m_dirty &= ~(uint32_t)dirty_geometry;
+
+    size_t coarse = 1;
+    while(coarse * 2 <= coarse_step) coarse *= 2;
+
+    ProgressiveResult result;
+    for(size_t step = coarse; step >= 1; step /= 2) result.total_passes++;
+
+    //Tiles are aligned to the coarse step, so blocks never cross tiles.
+    const size_t tile = ((std::max(tile_size, coarse) + coarse - 1) / coarse) * coarse;
+    const size_t tiles_x = (width + tile - 1) / tile;
+    const size_t tiles_y = (height + tile - 1) / tile;
+    work_stealing_scheduler scheduler(thread_count);
+    std::atomic<size_t> traced {0};
+    std::atomic<bool> expired {false};
+
+    for(size_t step = coarse; step >= 1; step /= 2){
+        const bool first_pass = step == coarse;
+        std::atomic<bool> pass_complete {true};
+        scheduler.run(tiles_x * tiles_y, [&](size_t index, size_t){
+            //The first pass always finishes, so there is an image in any case.
+            if(!first_pass && (expired || render_clock.elapsed() > deadline)){
+                expired = true;
+                pass_complete = false;
+                return;
+            }
+            ProfileZone tile_zone("tile", "render", index);
+            size_t x0 = (index % tiles_x) * tile, y0 = (index / tiles_x) * tile;
+            size_t x1 = std::min(x0 + tile, width), y1 = std::min(y0 + tile, height);
+            size_t count = 0;
+            for(size_t y = y0; y < y1; y += step)
+                for(size_t x = x0; x < x1; x += step){
+                    //Pixels on the grid of the previous pass have already been traced.
+                    if(!first_pass && x % (2 * step) == 0 && y % (2 * step) == 0) continue;
+                    Vec3<float> start, dir;
+                    view.ray((float)x, (float)y, start, dir);
+                    Ray raycast(camera.max_ray_bounces, start, dir);
+                    raycast.m_primary = true;
+                    Color color = raycast.fire(scene);
+                    //Fill block of pixel until finer passes replace it.
+                    for(size_t by = y; by < std::min(y + step, y1); by++)
+                        for(size_t bx = x; bx < std::min(x + step, x1); bx++)
+                            (*m_img)(bx, by) = color;
+                    count++;
+                }
+            traced += count;
+        });
+        if(!pass_complete) break;
+        result.completed_passes++;
+        result.finest_step = step;
+        if(step == 1) break;
+    }
+
+    result.progress = (float)traced / (float)(width * height);
+    result.elapsed = render_clock.stop();
+    std::cout << "Progressive render: " << result.completed_passes << "/" << result.total_passes << " passes, "
+              << (result.progress * 100) << "% of pixels traced in " << (result.elapsed/1000000) << "ms" << std::endl;
+    display(m_img);
+    return result;
+}
+
+void Raytracer::render_stream(size_t width, size_t height, const BandSink& sink, size_t band_height, size_t max_bands_in_flight){
+    if(width == 0 || height == 0) throw "Cannot render frame of size 0.";
+    if(band_height == 0) band_height = 1;
+    if(max_bands_in_flight == 0) max_bands_in_flight = 2 * thread_pool::global().thread_count();
+    if(max_bands_in_flight == 0) max_bands_in_flight = 1;
+
+    ProfileZone zone("stream render", "frame");
+    Clock render_clock;
+    View view = prepare_frame(width, height, scene.m_dirty & dirty_geometry);
+    const size_t band_count = (height + band_height - 1) / band_height;
+    const size_t slots = std::min(max_bands_in_flight, band_count);
+    const size_t tile = tile_size ? tile_size : 1;
+    const bool packets = (packet_size == 4 || packet_size == 8) && scene.m_bvh && scene.m_bvh->supports_packets();
+
+    //Each band in flight owns a slot (buffer). Band b always uses slot b % slots.
+    std::vector<std::unique_ptr<Image>> buffers(slots);
+    std::vector<char> finished(slots, false);
+    std::vector<Color> rows(band_height * width);
+    std::mutex mutex;
+    std::condition_variable slot_freed;
+    size_t next_to_emit = 0;
+    //Set if the sink has thrown. No more bands are emitted, the exception is rethrown by group.wait().
+    bool failed = false;
+
+    auto emit_finished_bands = [&](){
+        //Called with mutex locked. Emits all bands which are finished and next in order.
+        while(!failed && next_to_emit < band_count && finished[next_to_emit % slots]){
+            size_t slot = next_to_emit % slots;
+            size_t first_row = next_to_emit * band_height;
+            size_t count = std::min(band_height, height - first_row);
+            buffers[slot]->read_rows(0, count, rows.data());
+            ProfileZone sink_zone("band output", "output", next_to_emit);
+            try {
+                sink(first_row, count, rows.data());
+            } catch(...) {
+                failed = true;
+                slot_freed.notify_all();
+                throw;
+            }
+            finished[slot] = false;
+            next_to_emit++;
+        }
+        slot_freed.notify_all();
+    };
+
+    task_group group;
+    for(size_t b = 0; b < band_count; b++){
+        const size_t slot = b % slots;
+        {
+            //Wait until the band which used this slot before has been emitted. Help with queued bands meanwhile.
+            std::unique_lock<std::mutex> lock(mutex);
+            while(!failed && next_to_emit + slots <= b){
+                lock.unlock();
+                bool helped = thread_pool::global().run_pending_task();
+                lock.lock();
+                if(!helped && !failed && next_to_emit + slots <= b) slot_freed.wait(lock);
+            }
+            if(failed) break;
+        }
+        const size_t y0 = b * band_height;
+        const size_t y1 = std::min(y0 + band_height, height);
+        if(!buffers[slot]) buffers[slot].reset(new Image(width, band_height));
+
+        group.run([&, slot, y0, y1, b](){
+            ProfileZone band_zone("band", "render", b);
+            Image& target = *buffers[slot];
+            try {
+                for(size_t x0 = 0; x0 < width; x0 += tile){
+                    if(packets)     render_tile_packets(view, target, y0, x0, y0, std::min(x0 + tile, width), y1);
+                    else/******/    render_tile(view, target, y0, x0, y0, std::min(x0 + tile, width), y1);
+                }
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+                slot_freed.notify_all();
+                throw;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            finished[slot] = true;
+            emit_finished_bands();
+        });
+    }
+    group.wait();
+
+    auto time = render_clock.stop();
+    std::cout << "Elapsed time: " << (int)time << "ns = " << (time/1000000) << "ms" << std::endl;
+    std::cout << "Primary rays/s: " << (width * height) / (time / 1000000000) << std::endl;
+}
+
+void Raytracer::render_to_file(const char* dest, size_t width, size_t height, size_t band_height, size_t max_bands_in_flight){
+    auto writer = ImageWriter::create(dest);
+    writer->begin(dest, width, height);
+    render_stream(width, height, [&](size_t, size_t rows, const Color* pixels){
+        writer->write_rows(pixels, rows);
+    }, band_height, max_bands_in_flight);
+    writer->finish();
+}
+
+void Raytracer::shade(const View& view){
+    ProfileZone zone("shade", "render");
+    const size_t width = m_img->width();
+    work_stealing_scheduler scheduler(thread_count);
+    scheduler.run(m_img->height(), [&](size_t y, size_t worker){
+        StatisticsScope scope(worker_statistics(worker));
+        for(size_t x = 0; x < width; x++){
+            const GBufferEntry& entry = m_gbuffer[y * width + x];
+            Vec3<float> start, dir;
+            view.ray((float)x, (float)y, start, dir);
+            Ray raycast(camera.max_ray_bounces, start, dir);
+            raycast.m_closest = {entry.point, entry.object};
+            (*m_img)(x, y) = raycast.process(scene);
+        }
+    });
+}
+
+void Raytracer::write_heatmap(const char* dest, CostMetric metric) const {
+    const size_t width = m_img->width();
+    const size_t height = m_img->height();
+    if(m_pixel_cost.size() != width * height) throw "No pixel cost recorded. Set record_cost before rendering.";
+
+    std::vector<double> values(m_pixel_cost.size());
+    for(size_t i = 0; i < values.size(); i++){
+        const PixelCost& cost = m_pixel_cost[i];
+        values[i] = metric == CostMetric::intersection_tests ? cost.intersection_tests
+                  : (metric == CostMetric::reflection_rays ? cost.reflection_rays : (double)cost.cycles);
+    }
+    //Scale to 99th percentile, so few extreme pixels do not hide the rest.
+    std::vector<double> sorted = values;
+    auto percentile = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), percentile, sorted.end());
+    double scale = *percentile > 0 ? 1 / *percentile : 0;
+
+    //Color map: black -> blue -> red -> yellow -> white.
+    static const Color stops[] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+    const size_t segments = sizeof(stops) / sizeof(stops[0]) - 1;
+    Image heatmap(width, height);
+    for(size_t y = 0; y < height; y++)
+        for(size_t x = 0; x < width; x++){
+            float v = (float)std::min(values[y * width + x] * scale, 1.0) * segments;
+            size_t segment = std::min((size_t)v, segments - 1);
+            float f = v - segment;
+            const Color& a = stops[segment];
+            const Color& b = stops[segment + 1];
+            Color& pixel = heatmap(x, y);
+            pixel.r = a.r + (b.r - a.r) * f;
+            pixel.g = a.g + (b.g - a.g) * f;
+            pixel.b = a.b + (b.b - a.b) * f;
+        }
+    heatmap.write(dest);
+    std::cout << "Heatmap '" << dest << "': white = " << *percentile << (metric == CostMetric::intersection_tests ? " tests"
+              : (metric == CostMetric::reflection_rays ? " reflection rays" : " cycles")) << " per pixel" << std::endl;
+}
+
+SamplingResult Raytracer::supersample(const View& view){
+    const size_t width = m_img->width();
+    const size_t height = m_img->height();
+    SamplingResult result;
+    result.pixels = width * height;
+    result.samples = result.pixels;
+    result.uniform_samples = result.pixels * std::max<size_t>(max_samples, 1);
+    if(max_samples <= 1) return result;
+    ProfileZone zone("supersample", "render");
+
+    //1. Find pixels with high contrast to their right or lower neighbour and mark both.
+    //   The base image is only read here, so marking does not depend on refined pixels.
+    std::vector<uint8_t> marked(width * height, 0);
+    for(size_t y = 0; y < height; y++)
+        for(size_t x = 0; x < width; x++){
+            float b = (*m_img)(x, y).brightness();
+            if(x + 1 < width && std::abs(b - (*m_img)(x + 1, y).brightness()) > contrast_threshold)
+                marked[y * width + x] = marked[y * width + x + 1] = 1;
+            if(y + 1 < height && std::abs(b - (*m_img)(x, y + 1).brightness()) > contrast_threshold)
+                marked[y * width + x] = marked[(y + 1) * width + x] = 1;
+        }
+
+    //2. Add samples to marked pixels in parallel. Sub-pixel offsets follow a low-discrepancy (R2) sequence,
+    //   the base sample sits at offset (0, 0). Samples are added in batches of 4 until the brightness
+    //   variance is low enough or max_samples has been reached.
+    const float alpha_x = 0.7548776662f, alpha_y = 0.5698402910f;
+    const float max_variance = (contrast_threshold * 0.5f) * (contrast_threshold * 0.5f);
+    std::atomic<size_t> refined {0}, extra {0};
+    work_stealing_scheduler scheduler(thread_count);
+    scheduler.run(height, [&](size_t y, size_t worker){
+        StatisticsScope scope(worker_statistics(worker));
+        size_t row_refined = 0, row_extra = 0;
+        for(size_t x = 0; x < width; x++){
+            if(!marked[y * width + x]) continue;
+            CostProbe probe(m_pixel_cost.empty() ? nullptr : &m_pixel_cost[y * width + x]);
+            Color color = (*m_img)(x, y);
+            float sum = color.brightness(), sum_sq = sum * sum;
+            size_t n = 1;
+            while(n < max_samples){
+                size_t batch_end = std::min(n + 4, max_samples);
+                for(; n < batch_end; n++){
+                    float ox = std::fmod(0.5f + alpha_x * n, 1.0f), oy = std::fmod(0.5f + alpha_y * n, 1.0f);
+                    Vec3<float> start, dir;
+                    view.ray(x + ox, y + oy, start, dir);
+                    Ray raycast(camera.max_ray_bounces, start, dir);
+                    raycast.m_primary = true;
+                    Color c = raycast.fire(scene);
+                    color += c;
+                    float l = c.brightness();
+                    sum += l;
+                    sum_sq += l * l;
+                }
+                float mean = sum / n;
+                if(sum_sq / n - mean * mean <= max_variance) break;
+            }
+            (*m_img)(x, y) = color / (float)n;
+            row_refined++;
+            row_extra += n - 1;
+        }
+        refined += row_refined;
+        extra += row_extra;
+    });
+    result.refined_pixels = refined;
+    result.samples += extra;
+    return result;
+}
+
+/**
+ * @brief Store primary intersection of a pixel in the G-buffer.
+ */
+static inline void store_primary(GBufferEntry& entry, const Intersection& inter){
+    entry.point = inter.point;
+    entry.object = inter.object;
+}
+
+/**
+ * @brief Primary rays of a section of a row, generated by View::rays().
+ */
+struct PrimaryRays {
+    static constexpr size_t max_size {64};
+    alignas(16) float ox[max_size], oy[max_size], oz[max_size];
+    alignas(16) float dx[max_size], dy[max_size], dz[max_size];
+
+    inline void generate(const View& view, size_t x, size_t y, size_t count) noexcept { view.rays(x, y, count, ox, oy, oz, dx, dy, dz); }
+    inline Vec3<float> start(size_t i) const noexcept { return {ox[i], oy[i], oz[i]}; }
+    inline Vec3<float> dir(size_t i) const noexcept { return {dx[i], dy[i], dz[i]}; }
+};
+
+void Raytracer::render_tile(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer, PixelCost* cost){
+    PrimaryRays rays;
+    for(size_t y = y0; y < y1; y++)
+        for(size_t x = x0; x < x1; x++){
+            //1. Generate primary rays of the next pixels of the row at once.
+            size_t i = (x - x0) % PrimaryRays::max_size;
+            if(i == 0) rays.generate(view, x, y, std::min(PrimaryRays::max_size, x1 - x));
+            CostProbe probe(cost ? &cost[(y - row_offset) * m_width + x] : nullptr);
+            //2. Cast ray from generated start, direction and bounce limit.
+            Ray raycast(camera.max_ray_bounces, rays.start(i), rays.dir(i));
+            raycast.m_primary = true;
+            target(x, y - row_offset) = raycast.fire(scene);
+            //     ^Pixel                   ^Visible data
+            if(gbuffer) store_primary(gbuffer[(y - row_offset) * m_width + x], raycast.m_closest);
+        }
+}
+
+void Raytracer::render_tile_packets(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer){
+    const size_t block = packet_size;
+    RayPacket packet;
+    packet.size = block * block;
+
+    for(size_t by = y0; by < y1; by += block)
+        for(size_t bx = x0; bx < x1; bx += block){
+            //1. Generate primary rays of block row by row. Lanes outside the tile are disabled.
+            for(size_t row = 0; row < block; row++){
+                size_t first = row * block;
+                size_t count = by + row < y1 ? std::min(block, x1 - bx) : 0;
+                if(count) view.rays(bx, by + row, count, packet.ox + first, packet.oy + first, packet.oz + first,
+                                    packet.dx + first, packet.dy + first, packet.dz + first);
+                for(size_t i = first; i < first + block; i++)
+                    if(i < first + count)   packet.update(i);
+                    else/**************/    packet.disable(i);
+            }
+
+            //2. Intersection stage for the whole packet.
+            RenderStatistics* statistics = RenderStatistics::current;
+            Clock stage_clock(statistics != nullptr);
+            scene.m_bvh->intersect(packet, scene.culled_nodes());
+            if(statistics){
+                statistics->intersection_time += stage_clock.elapsed();
+                for(size_t i = 0; i < packet.size; i++)
+                    if(packet.t[i] >= 0){
+                        statistics->primary_rays++;
+                        statistics->bounce_histogram[0]++;
+                        statistics->intersection_hits += packet.hit[i] != UINT32_MAX;
+                    }
+            }
+
+            //3. Materialization stage per ray. Reflections diverge, so they are traced as single rays.
+            for(size_t i = 0; i < packet.size; i++){
+                size_t x = bx + i % block, y = by + i / block;
+                if(x >= x1 || y >= y1) continue;
+                Vec3<float> start = {packet.ox[i], packet.oy[i], packet.oz[i]};
+                Vec3<float> dir = {packet.dx[i], packet.dy[i], packet.dz[i]};
+                Ray raycast(camera.max_ray_bounces, start, dir);
+                if(packet.hit[i] != UINT32_MAX)
+                    raycast.intersection({start + dir * packet.t[i], scene.m_bvh->primitive(packet.hit[i])}, packet.t[i]);
+                target(x, y - row_offset) = raycast.process(scene);
+                if(gbuffer) store_primary(gbuffer[(y - row_offset) * m_width + x], raycast.m_closest);
+            }
+        }
+}
+
+/**
+ * @brief Ray in a wavefront queue.
+ */
+struct WavefrontRay {
+    Vec3<float>     origin, dir;
+    Renderable*     ignore;
+    /**
+     * @brief Closest intersection (written by the intersection stage).
+     */
+    Intersection    hit;
+    /**
+     * @brief Product of the bounce weights of the path up to this ray.
+     */
+    float           weight;
+    /**
+     * @brief Pixel index in tile.
+     */
+    uint32_t        pixel;
+};
+
+/**
+ * @brief Queues and colors of wavefront rendering. Kept per thread, so their memory is reused by all tiles.
+ */
+struct WavefrontBuffers {
+    std::vector<WavefrontRay>   queue, next;
+    std::vector<uint32_t>       order;
+    std::vector<Color>          colors;
+};
+
+void Raytracer::render_tile_wavefront(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer){
+    thread_local WavefrontBuffers buffers;
+    std::vector<WavefrontRay>& queue = buffers.queue;
+    std::vector<WavefrontRay>& next = buffers.next;
+    std::vector<uint32_t>& order = buffers.order;
+    std::vector<Color>& colors = buffers.colors;
+    const size_t width = x1 - x0;
+    const size_t height = y1 - y0;
+    RenderStatistics* statistics = RenderStatistics::current;
+
+    //1. Queue primary rays. With packets, rays are queued in packet_size x packet_size blocks, otherwise row by row.
+    const bool packets = (packet_size == 4 || packet_size == 8) && scene.m_bvh && scene.m_bvh->supports_packets();
+    const size_t block = packets ? packet_size : std::max(width, height);
+    queue.clear();
+    colors.assign(width * height, Color());
+    PrimaryRays rays;
+    for(size_t by = y0; by < y1; by += block)
+        for(size_t bx = x0; bx < x1; bx += block)
+            for(size_t y = by; y < std::min(by + block, y1); y++)
+                for(size_t x = bx; x < std::min(bx + block, x1); x++){
+                    size_t i = (x - bx) % PrimaryRays::max_size;
+                    if(i == 0) rays.generate(view, x, y, std::min({PrimaryRays::max_size, x1 - x, bx + block - x}));
+                    queue.push_back({rays.start(i), rays.dir(i), nullptr, Intersection(), 1, (uint32_t)((y - y0) * width + (x - x0))});
+                }
+
+    size_t bounces = camera.max_ray_bounces;
+    for(size_t depth = 0; !queue.empty(); depth++, bounces--){
+        //2. Intersection stage for the whole queue. Primary rays are coherent and traced as packets, bounces as
+        //   single rays (the BVH tests leaves with SIMD kernels).
+        if(depth == 0 && packets){
+            Clock stage_clock(statistics != nullptr);
+            RayPacket packet;
+            for(size_t first = 0; first < queue.size(); first += RayPacket::max_size){
+                size_t count = std::min(RayPacket::max_size, queue.size() - first);
+                packet.size = (count + 3) & ~(size_t)3;
+                for(size_t i = 0; i < packet.size; i++)
+                    if(i < count)   packet.set(i, queue[first + i].origin, queue[first + i].dir);
+                    else/*******/   packet.disable(i);
+                scene.m_bvh->intersect(packet, scene.culled_nodes());
+                for(size_t i = 0; i < count; i++){
+                    WavefrontRay& ray = queue[first + i];
+                    if(packet.hit[i] != UINT32_MAX) ray.hit = {ray.origin + ray.dir * packet.t[i], scene.m_bvh->primitive(packet.hit[i])};
+                }
+            }
+            if(statistics){
+                statistics->intersection_time += stage_clock.elapsed();
+                statistics->primary_rays += queue.size();
+                statistics->bounce_histogram[0] += queue.size();
+                for(const WavefrontRay& ray : queue) statistics->intersection_hits += ray.hit.object != nullptr;
+            }
+        } else {
+            for(WavefrontRay& ray : queue){
+                Ray raycast(bounces, ray.origin, ray.dir);
+                raycast.m_ignore = ray.ignore;
+                raycast.m_primary = depth == 0;
+                raycast.cast(scene);
+                ray.hit = raycast.m_closest;
+            }
+        }
+        if(depth == 0 && gbuffer)
+            for(const WavefrontRay& ray : queue){
+                size_t x = x0 + ray.pixel % width, y = y0 + ray.pixel / width;
+                store_primary(gbuffer[(y - row_offset) * m_width + x], ray.hit);
+            }
+
+        //3. Sort hits by material and object, so materialization runs in batches of equal surfaces.
+        Clock stage_clock(statistics != nullptr);
+        double nested = statistics ? statistics->intersection_time + statistics->materialization_time : 0;
+        order.resize(queue.size());
+        for(size_t i = 0; i < order.size(); i++) order[i] = (uint32_t)i;
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){
+            const Renderable* object_a = queue[a].hit.object;
+            const Renderable* object_b = queue[b].hit.object;
+            if(!object_a || !object_b) return object_a > object_b;
+            if(object_a->material.diffuseness != object_b->material.diffuseness)
+                return object_a->material.diffuseness < object_b->material.diffuseness;
+            return object_a < object_b;
+        });
+
+        //4. Materialization stage in sorted order. Continuations form the queue of the next bounce.
+        next.clear();
+        for(uint32_t index : order){
+            const WavefrontRay& ray = queue[index];
+            Color& color = colors[ray.pixel];
+            Ray raycast(bounces, ray.origin, ray.dir);
+            if(!ray.hit.object){
+                //Rays without intersection keep their color (background).
+                if(depth == 0)  color = raycast.m_color;
+                else/*******/   color += raycast.m_color * ray.weight;
+                continue;
+            }
+            Bounce bounce;
+            Color hit_color = ray.hit.object->shade(scene, ray.hit.point, raycast, bounce);
+            if(depth == 0)  color = hit_color;
+            else/*******/   color += hit_color * ray.weight;
+            if(bounce.weight > 0 && bounces > 0)
+                next.push_back({bounce.origin, bounce.dir, bounce.ignore, Intersection(), ray.weight * bounce.weight, ray.pixel});
+        }
+        if(statistics){
+            nested = statistics->intersection_time + statistics->materialization_time - nested;
+            statistics->materialization_time += stage_clock.elapsed() - nested;
+        }
+        std::swap(queue, next);
+    }
+
+    for(size_t y = y0; y < y1; y++)
+        for(size_t x = x0; x < x1; x++)
+            target(x, y - row_offset) = colors[(y - y0) * width + (x - x0)];
+}
+
 Raytracer::Raytracer(Image* img)
 : m_img{img}
 {
@@ -78,18 +783,57 @@ Ray::Ray(const size_t max_bounces, Vec3<float> start, Vec3<float> dir)
 }
 
 Color Ray::fire(const SceneData& scene) {
+    cast(scene);
+    return process(scene);
+}
+
+void Ray::cast(const SceneData& scene) {
+    RenderStatistics* statistics = RenderStatistics::current;
+    Clock stage_clock(statistics != nullptr);
+
     //Stage 1: Intersection phase - calculate all possible intersections (with visible objects).
-    for(Renderable* object : scene.m_render_list){
-        if(object->m_visible && object != m_ignore)
-            object->intersect(*this);
+    scene.intersect(*this);
+
+    if(statistics){
+        statistics->intersection_time += stage_clock.elapsed();
+        size_t depth = statistics->max_bounces > (int)m_max_bounces ? statistics->max_bounces - m_max_bounces : 0;
+        if(depth == 0)  statistics->primary_rays++;
+        else/*******/   statistics->reflection_rays++;
+        statistics->bounce_histogram[std::min(depth, RenderStatistics::max_depth - 1)]++;
     }
-    
+}
+
+Color Ray::process(const SceneData& scene) {
+    RenderStatistics* statistics = RenderStatistics::current;
+    //Time of rays fired while processing (e.g. reflections) is not part of this ray's materialization time.
+    double nested = statistics ? statistics->intersection_time + statistics->materialization_time : 0;
+    Clock stage_clock(statistics != nullptr);
+
     //Check if any intersections were registered.
     if(m_closest.object){
-        //Process intersection
-        m_color = m_closest.object->process(scene, m_closest.point, *this);
+        //Process intersection, then follow bounces in a loop (no recursion, nothing allocated).
+        Bounce next;
+        Color color = m_closest.object->shade(scene, m_closest.point, *this, next);
+        float weight = 1;
+        size_t bounces = m_max_bounces;
+        while(next.weight > 0 && bounces > 0){
+            weight *= next.weight;
+            Ray bounce(--bounces, next.origin, next.dir);
+            bounce.m_ignore = next.ignore;
+            bounce.cast(scene);
+            next = Bounce();
+            //Rays without intersection keep their color (background).
+            Color bounce_color = bounce.m_closest.object ? bounce.m_closest.object->shade(scene, bounce.m_closest.point, bounce, next)
+                                                         : bounce.m_color;
+            color += bounce_color * weight;
+        }
+        m_color = color;
     } // else: Skip processing stage.
 
+    if(statistics){
+        nested = statistics->intersection_time + statistics->materialization_time - nested;
+        statistics->materialization_time += stage_clock.elapsed() - nested;
+    }
     return m_color;
 }
 
@@ -103,15 +847,20 @@ void Ray::intersection(const Intersection& inter){
     else
         dist = (inter.point.z - m_start.z) / m_dir.z;
 
-    //Step 2: Check if factor along direction vector of ray is positive.
-    if(dist > 0){
+    //Step 2: Check if factor along direction vector of ray is inside the query interval.
+    if(dist > m_min_distance){
         //Step 3: Compare to last intersection or set as closest intersection if there is no other
         if(!m_closest.object){
+            if(dist >= m_closest_distance) return;
             m_closest = inter;
+            m_closest_distance = dist;
         }else{
             //Step 4: Compare both distances from the camera. Set to closest.
             float _dist = (m_start - m_closest.point).length();
-            if(abs(dist) < _dist) m_closest = inter;
+            if(abs(dist) < _dist){
+                m_closest = inter;
+                m_closest_distance = dist;
+            }
         }
     }// else: Don't register intersection
     
@@ -124,16 +873,46 @@ BoundingBox::BoundingBox(float x1, float x2, float y1, float y2, float z1, float
     b = {-x2, -y2, -z2};
 }
 
-bool BoundingBox::check_visibility(const Camera& cam, const View& view){
-    //TODO
-    return false;
-};
+void Ray::query(float t_min, float t_max, QueryMode mode){
+    m_min_distance = t_min;
+    m_closest_distance = t_max;
+    m_mode = mode;
+}
+
+void Ray::intersection(const Intersection& inter, float distance){
+    if(distance > m_min_distance && distance < m_closest_distance){
+        m_closest = inter;
+        m_closest_distance = distance;
+    }
+}
+
+BoundingBox::BoundingBox(const Vec3<float>& max, const Vec3<float>& min)
+: a{max}, b{min}
+{}
+
+bool BoundingBox::is_finite() const noexcept {
+    return std::isfinite(a.x) && std::isfinite(a.y) && std::isfinite(a.z)
+        && std::isfinite(b.x) && std::isfinite(b.y) && std::isfinite(b.z);
+}
+
+BoundingBox BoundingBox::infinite() noexcept {
+    return BoundingBox({INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY});
+}
 
-std::array<Vec3<float>, 8> BoundingBox::get_points() noexcept {
+BoundingBox Renderable::bounds() const {
+    return BoundingBox::infinite();
+}
+
+bool BoundingBox::check_visibility(const Camera& cam, const View& view) const {
+    if(!is_finite()) return true;
+    return Frustum(cam, view).classify(b, a) >= 0;
+}
+
+std::array<Vec3<float>, 8> BoundingBox::get_points() const noexcept {
     std::array<Vec3<float>, 8> arr;
     arr[0] = a;
     arr[1] = {a.x, a.y, b.z};
-    arr[2] = {a.x, b.x, a.z};
+    arr[2] = {a.x, b.y, a.z};
     arr[3] = {b.x, a.y, a.z};
     arr[4] = b;
     arr[5] = {b.x, b.y, a.z};
@@ -143,47 +922,53 @@ std::array<Vec3<float>, 8> BoundingBox::get_points() noexcept {
 };
 
 bool Sphere::intersect(Ray& ray){
-    Vec3<float> camera2center = pos - ray.m_start; 
-    float dist = std::sin(angle(camera2center, ray.m_dir)) * camera2center.length(); 
-    //Detect if ray hits the sphere. If so, calculate the intersecting points...
-    if(dist <= radius){
-        
-        float midpoint_dist = std::sqrt(std::pow(camera2center.length(), 2) - std::pow(dist, 2));
-        //Vec3<float> midpoint = ray.m_start + ray.m_dir * midpoint_dist;
-
-        float delta = sin(0.5f * PI* ((radius - dist)/radius));
-        float alpha = delta * radius;
-        
-        Vec3<float> inter1 = ray.m_start + ray.m_dir * (midpoint_dist - alpha);
-        Vec3<float> inter2 = ray.m_start + ray.m_dir * (midpoint_dist + alpha);
-        
-        //Check if that point is in front of the camera by caluclating the distance to sphere center.
-        if((inter1 - pos).length() <= radius) ray.intersection({inter1, this});
-        if((inter2 - pos).length() <= radius) ray.intersection({inter2, this});
-
-        return true;
-    } else return false;
+    float t = intersect_sphere(pos - ray.m_start, ray.m_dir, radius * radius, ray.m_min_distance);
+    if(t == INFINITY) return false;
+    ray.intersection({ray.m_start + ray.m_dir * t, this}, t);
+    return true;
+}
+
+BoundingBox Sphere::bounds() const {
+    Vec3<float> extent = {radius, radius, radius};
+    return BoundingBox(pos + extent, pos - extent);
+}
+
+Vec3<float> Renderable::normal_at(const Vec3<float>&) const {
+    return {0, 0, 0};
+}
+
+Vec3<float> Sphere::normal_at(const Vec3<float>& point) const {
+    return (point - pos).norm();
+}
+
+Color Renderable::shade(const SceneData& scene, const Vec3<float>& point, const Ray& ray, Bounce&){
+    return process(scene, point, ray);
 }
 
 Color Sphere::process(const SceneData& scene, const Vec3<float>& point, const Ray& ray){
-    Vec3<float> normal = (point - pos).norm();
+    Bounce next;
+    Color pixel_color = shade(scene, point, ray, next);
+    if(next.weight > 0){
+        Ray reflection_ray(ray.m_max_bounces - 1, next.origin, next.dir);
+        reflection_ray.m_ignore = next.ignore;
+        pixel_color += reflection_ray.fire(scene) * next.weight;
+    }
+    return pixel_color;
+}
+
+Color Sphere::shade(const SceneData& scene, const Vec3<float>& point, const Ray& ray, Bounce& next){
+    Vec3<float> normal = normal_at(point);
 
     //If no more bounces allowed, use diffuse color to 100%
     float diffuseness = ray.m_max_bounces == 0 ? 1 : material.diffuseness;
     Color pixel_color = {0,0,0};
 
-    //Reflection calculation
+    //Reflection: continued by the caller.
     if(diffuseness != 1) {
-        Color reflection_color = {0,0,0};
-        Vec3<float> reflect = (ray.m_dir - (normal * normal.dot(ray.m_dir) * 2)).norm();
-        
-        Ray reflection_ray(ray.m_max_bounces - 1, point, reflect);
-        reflection_ray.m_ignore = this;
-        //m_visible = false;
-        reflection_color = reflection_ray.fire(scene);
-        //m_visible = true;
-
-        pixel_color += reflection_color * (1 - diffuseness);
+        next.origin = point;
+        next.dir = (ray.m_dir - (normal * normal.dot(ray.m_dir) * 2)).norm();
+        next.weight = 1 - diffuseness;
+        next.ignore = this;
     }
 
     //Diffuse calculation
@@ -191,20 +976,45 @@ Color Sphere::process(const SceneData& scene, const Vec3<float>& point, const Ra
         Color diffuse_color = material.base_color;
 
         Color light_color = {0,0,0};
-        for(Light* current_light : scene.light_list){
-            Vec3<float> point_to_light      = current_light->pos - point;
-            float       distance_to_light   = point_to_light.length();
-            //Check for Shadows here.
+        //Lights are handled in groups of four: directions, distances and falloff of a group are calculated at once,
+        //occlusion and color per light.
+        const Vec3x4 point4 = Vec3x4::splat(point), normal4 = Vec3x4::splat(normal);
+        const Float4 zero = Float4::splat(0), one = Float4::splat(1);
+        auto light_group = [&](Light* const* lights, size_t count){
+            const Light* l[4];
+            for(size_t i = 0; i < 4; i++) l[i] = lights[i < count ? i : 0];
+            Vec3x4 point_to_light = Vec3x4::set(l[0]->pos, l[1]->pos, l[2]->pos, l[3]->pos) - point4;
+            Float4 range = Float4::set(l[0]->distance, l[1]->distance, l[2]->distance, l[3]->distance);
+            Float4 distance_to_light = point_to_light.length();
+            uint32_t in_range = distance_to_light.less_equal(range).bits() & ((1u << count) - 1);
+            if(!in_range) return;
 
-            if(distance_to_light <= current_light->distance){
-                float _dot_product      = point_to_light.norm().dot(normal);
-                float angle_factor      = _dot_product > 1 ? 1 : (_dot_product < 0 ? 0 : _dot_product);
-                float distance_factor   = (current_light->distance - distance_to_light) / current_light->distance;
+            Float4 dot_product = point_to_light.norm().dot(normal4);
+            Float4 angle_factor = dot_product.select(dot_product.greater(one), one);
+            angle_factor = angle_factor.select(dot_product.less(zero), zero);
+            Float4 distance_factor = (range - distance_to_light) / range;
+            //To counteract quadratic falloff
+            float angle[4], falloff[4];
+            angle_factor.sqrt().store(angle);
+            distance_factor.sqrt().store(falloff);
 
-                light_color += current_light->color * sqrt(angle_factor) * sqrt(distance_factor) * current_light->intensity;
-                //                                    ^ To counteract quadratic falloff
+            while(in_range){
+                uint32_t i = count_trailing_zeros(in_range);
+                in_range &= in_range - 1;
+                if(!scene.occluded(point, l[i], this))
+                    light_color += l[i]->color * angle[i] * falloff[i] * l[i]->intensity;
+            }
+        };
+        Light* group[4];
+        size_t count = 0;
+        for(Light* current_light : scene.light_list){
+            group[count++] = current_light;
+            if(count == 4){
+                light_group(group, count);
+                count = 0;
             }
         }
+        if(count) light_group(group, count);
 
         //Mix with pixel color
         diffuse_color *= light_color;
@@ -215,24 +1025,172 @@ Color Sphere::process(const SceneData& scene, const Vec3<float>& point, const Ra
     
 }
 
+void SceneData::build_acceleration(const char* cache_path){
+    m_bvh = std::make_shared<const BVH>(m_render_list, cache_path);
+    m_bvh_generation = m_generation;
+}
+
+void SceneData::build_primitives(){
+    m_primitives = std::make_shared<const PrimitiveStore>(m_render_list, m_generation);
+}
+
+size_t SceneData::cull(const Camera& camera, const View& view){
+    const Frustum frustum(camera, view);
+    if(m_bvh){
+        //Objects without finite bounds are never culled.
+        m_culled_objects = m_bvh->cull(frustum, m_culled_nodes);
+        m_culled_bvh = m_bvh;
+        m_primary_primitives.reset();
+        return m_culled_objects;
+    }
+    std::vector<Renderable*> candidates;
+    candidates.reserve(m_render_list.size());
+    for(Renderable* object : m_render_list){
+        BoundingBox box = object->bounds();
+        if(!box.is_finite() || frustum.classify(box.b, box.a) >= 0) candidates.push_back(object);
+    }
+    m_primary_primitives = std::make_shared<const PrimitiveStore>(candidates, m_generation);
+    m_culled_bvh.reset();
+    m_culled_objects = m_render_list.size() - candidates.size();
+    return m_culled_objects;
+}
+
+void SceneData::intersect(Ray& ray) const {
+    if(m_bvh){
+        m_bvh->intersect(ray, ray.m_primary ? culled_nodes() : nullptr);
+        return;
+    }
+    if(ray.m_primary && m_primary_primitives && m_primary_primitives->generation() == m_generation){
+        m_primary_primitives->intersect(ray);
+        return;
+    }
+    if(m_primitives && m_primitives->generation() == m_generation){
+        m_primitives->intersect(ray);
+        return;
+    }
+    RenderStatistics* statistics = RenderStatistics::current;
+    for(Renderable* object : m_render_list){
+        if(object->m_visible && object != ray.m_ignore){
+            bool hit = object->intersect(ray);
+            if(statistics){
+                statistics->intersection_tests++;
+                statistics->intersection_hits += hit;
+            }
+            if(ray.done()) return;
+        }
+    }
+}
+
+/**
+ * @brief Last occluder per light of the current thread. Only valid for scene and generation it was filled for.
+ */
+struct OccluderCache {
+    const SceneData*                                    scene       {nullptr};
+    size_t                                              generation  {0};
+    std::unordered_map<const Light*, Renderable*>       occluders;
+};
+static thread_local OccluderCache occluder_cache;
+
+bool SceneData::occluded(const Vec3<float>& point, const Light* light, Renderable* ignore) const {
+    Vec3<float> to_light = light->pos - point;
+    float distance = to_light.length();
+    if(distance == 0) return false;
+
+    Ray shadow_ray(0, point, to_light * (1 / distance));
+    shadow_ray.m_ignore = ignore;
+    shadow_ray.query(0, distance, QueryMode::any_hit);
+    RenderStatistics* statistics = RenderStatistics::current;
+    if(statistics) statistics->shadow_rays++;
+
+    if(occluder_cache.scene != this || occluder_cache.generation != m_generation){
+        occluder_cache.scene = this;
+        occluder_cache.generation = m_generation;
+        occluder_cache.occluders.clear();
+    }
+
+    //Try last occluder of this light first.
+    auto cached = occluder_cache.occluders.find(light);
+    if(cached != occluder_cache.occluders.end()){
+        Renderable* occluder = cached->second;
+        if(occluder->m_visible && occluder != ignore){
+            occluder->intersect(shadow_ray);
+            if(statistics) statistics->intersection_tests++;
+            if(shadow_ray.m_closest.object){
+                if(statistics) statistics->intersection_hits++;
+                return true;
+            }
+        }
+    }
+
+    intersect(shadow_ray);
+    if(!shadow_ray.m_closest.object) return false;
+    occluder_cache.occluders[light] = shadow_ray.m_closest.object;
+    return true;
+}
+
+size_t SceneData::next_generation() noexcept {
+    static std::atomic<size_t> generation {0};
+    return generation.fetch_add(1) + 1;
+}
+
 void SceneData::add(Renderable* ren){
     if(!ren) throw "Cannot add nullptr as renderable.";
     m_render_list.push_back(ren);
+    m_generation = next_generation();
+    m_dirty |= dirty_geometry;
 }
 
 void SceneData::remove(Renderable* ren){
     if(!ren) throw "Cannot remove nullptr from renderable list.";
-    m_render_list.remove(ren); 
+    m_render_list.erase(std::remove(m_render_list.begin(), m_render_list.end(), ren), m_render_list.end());
+    m_generation = next_generation();
+    m_dirty |= dirty_geometry;
 }
 
 void SceneData::add(Light* light){
     if(!light) throw "Cannot add nullptr as light.";
     light_list.push_back(light);
+    m_dirty |= dirty_lights;
 }
 
 void SceneData::remove(Light* light){
     if(!light) throw "Cannot remove nullptr from lights list.";
     light_list.remove(light);
+    m_dirty |= dirty_lights;
+}
+
+void SceneData::adopt(std::unique_ptr<Sphere[]> spheres, size_t count){
+    if(!spheres && count) throw "Cannot adopt nullptr as spheres.";
+    m_render_list.reserve(m_render_list.size() + count);
+    for(size_t i = 0; i < count; i++) m_render_list.push_back(&spheres[i]);
+    m_owned_spheres.push_back(std::move(spheres));
+    m_generation = next_generation();
+    m_dirty |= dirty_geometry;
+}
+
+void SceneData::adopt(std::unique_ptr<Light[]> lights, size_t count){
+    if(!lights && count) throw "Cannot adopt nullptr as lights.";
+    for(size_t i = 0; i < count; i++) light_list.push_back(&lights[i]);
+    m_owned_lights.push_back(std::move(lights));
+    m_dirty |= dirty_lights;
+}
+
+void SceneData::update(Renderable* ren){
+    if(!ren) throw "Cannot update nullptr renderable.";
+    //Cached occluders may not occlude anymore.
+    m_generation = next_generation();
+    m_dirty |= dirty_geometry;
+}
+
+void SceneData::update(Light* light){
+    if(!light) throw "Cannot update nullptr light.";
+    m_dirty |= dirty_lights;
+}
+
+void SceneData::set_material(Renderable* ren, const Material& material){
+    if(!ren) throw "Cannot set material of nullptr renderable.";
+    ren->material = material;
+    m_dirty |= dirty_materials;
 }
 
 
@@ -245,7 +1203,8 @@ void display(const Image* img){
     for(size_t y = 0; y < height; y++){
         for(size_t x = 0; x < width; x++){
             Color& c = img->operator()(x, y);
-            COLORREF color = RGB(c.r * 255, c.g * 255, c.b * 255);
+            //Colors are HDR: clamp them to the displayable range.
+            COLORREF color = RGB(std::min(c.r, 1.0f) * 255, std::min(c.g, 1.0f) * 255, std::min(c.b, 1.0f) * 255);
             SetPixel(dc, x, y, color);
         }
     }
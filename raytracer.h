@@ -7,18 +7,41 @@
 
 #pragma once
 #include "math.h"
+#include "camera.h"
 #include "timing.h"
+#include "processing.h"
 #include <list>
 #include <fstream>
 #include <iostream>
 #include <array>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <vector>
+#include <string>
+#ifdef RAYTRACER_X86
+#include <xmmintrin.h>
+#endif
 //For displaying.
 #ifdef _WIN32
+//Keep std::min and std::max usable.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include <windows.h>
 #endif
 
-struct Color{
+/**
+ * @brief Linear RGB color. Values are not clamped (HDR): light may add up beyond 1. Clamping happens once, when the
+ * image is written or displayed (see convert_to_8bit()). Padded to 4 floats, so every operation is one SIMD instruction.
+ */
+struct alignas(16) Color{
     float r = 0, g = 0, b = 0;
+    /**
+     * @brief Padding (stays 0).
+     */
+    float _pad = 0;
     inline friend std::ostream& operator<<(std::ostream& stream, const Color& c){
         stream << (int)(c.r * 255) << std::endl;
         stream << (int)(c.g * 255) << std::endl;
@@ -26,78 +49,37 @@ struct Color{
         return stream;
     }
 
-    inline float brightness(){
+    inline float brightness() const {
         float max = r;
         if(g > max) max = g;
         if(b > max) max = b;
         return max;
     }
 
-    inline void add(float f){
-        r += f;
-        g += f;
-        b += f;
-        clamp_color();
-    }
-
-    inline void add(const Color& col){
-        r += col.r;
-        g += col.g;
-        b += col.b;
-        clamp_color();
-    }
-
-    inline void sub(float f){
-        r -= f;
-        g -= f;
-        b -= f;
-        clamp_color();
-    }
-
-    inline void sub(const Color& col){
-        r -= col.r;
-        g -= col.g;
-        b -= col.b;
-        clamp_color();
-    }
-
-    inline void mult(float f){
-        r *= f;
-        g *= f;
-        b *= f;
-        clamp_color();
-    }
-
-    inline void mult(const Color& col){
-        r *= col.r;
-        g *= col.g;
-        b *= col.b;
-        clamp_color();
-    }
-
-    inline void div(float f){
-        r /= f;
-        g /= f;
-        b /= f;
-        clamp_color();
-    }
-
-    inline void div(const Color& col){
-        r /= col.r;
-        g /= col.g;
-        b /= col.b;
-        clamp_color();
-    }
+#ifdef RAYTRACER_X86
+    inline __m128 load() const noexcept { return _mm_load_ps(&r); }
+    inline void store(__m128 v) noexcept { _mm_store_ps(&r, v); }
+    static inline __m128 splat(float f) noexcept { return _mm_setr_ps(f, f, f, 0); }
 
-    inline void clamp_color(){
-        Vec3<float> v = {r, g, b};
-        if(v.length() > 1){
-            auto _v = v.norm();
-            r = _v.x;
-            g = _v.y;    
-            b = _v.z;
-        }
-    }
+    inline void add(float f){ store(_mm_add_ps(load(), splat(f))); }
+    inline void add(const Color& col){ store(_mm_add_ps(load(), col.load())); }
+    inline void sub(float f){ store(_mm_sub_ps(load(), splat(f))); }
+    inline void sub(const Color& col){ store(_mm_sub_ps(load(), col.load())); }
+    inline void mult(float f){ store(_mm_mul_ps(load(), splat(f))); }
+    inline void mult(const Color& col){ store(_mm_mul_ps(load(), col.load())); }
+    inline void div(float f){ store(_mm_div_ps(load(), _mm_set1_ps(f))); }
+    //Padding of divisor is 1, so the padding stays 0.
+    inline void div(const Color& col){ store(_mm_div_ps(load(), _mm_setr_ps(col.r, col.g, col.b, 1))); }
+#else
+    inline void add(float f){ r += f; g += f; b += f; }
+    inline void add(const Color& col){ r += col.r; g += col.g; b += col.b; }
+    inline void sub(float f){ r -= f; g -= f; b -= f; }
+    inline void sub(const Color& col){ r -= col.r; g -= col.g; b -= col.b; }
+    inline void mult(float f){ r *= f; g *= f; b *= f; }
+    inline void mult(const Color& col){ r *= col.r; g *= col.g; b *= col.b; }
+    inline void div(float f){ r /= f; g /= f; b /= f; }
+    inline void div(const Color& col){ r /= col.r; g /= col.g; b /= col.b; }
+#endif
 
     inline void operator+=(const Color& col){ add(col); };
     inline void operator-=(const Color& col){ sub(col); };
@@ -108,42 +90,17 @@ struct Color{
     inline void operator*=(float col){ mult(col); };
     inline void operator/=(float col){ div(col); };
 
-    inline Color operator+(const Color& col){ Color _c(*this); _c.add(col); return _c; };
-    inline Color operator-(const Color& col){ Color _c(*this); _c.sub(col); return _c; };
-    inline Color operator*(const Color& col){ Color _c(*this); _c.mult(col); return _c; };
-    inline Color operator/(const Color& col){ Color _c(*this); _c.div(col); return _c; };
-    inline Color operator+(float col){ Color _c(*this); _c.add(col); return _c; };
-    inline Color operator-(float col){ Color _c(*this); _c.sub(col); return _c; };
-    inline Color operator*(float col){ Color _c(*this); _c.mult(col); return _c; };
-    inline Color operator/(float col){ Color _c(*this); _c.div(col); return _c; };
+    inline Color operator+(const Color& col) const { Color _c(*this); _c.add(col); return _c; };
+    inline Color operator-(const Color& col) const { Color _c(*this); _c.sub(col); return _c; };
+    inline Color operator*(const Color& col) const { Color _c(*this); _c.mult(col); return _c; };
+    inline Color operator/(const Color& col) const { Color _c(*this); _c.div(col); return _c; };
+    inline Color operator+(float col) const { Color _c(*this); _c.add(col); return _c; };
+    inline Color operator-(float col) const { Color _c(*this); _c.sub(col); return _c; };
+    inline Color operator*(float col) const { Color _c(*this); _c.mult(col); return _c; };
+    inline Color operator/(float col) const { Color _c(*this); _c.div(col); return _c; };
     
 };
 
-/**
- * @brief Transformation of an object (position, rotation, scale)
- */
-struct Transform{
-    Vec3<float> pos, rot, scale;
-};
-
-/**
- * @brief Raw camera data. View is calculated in rendering process.
- */
-struct Camera : Transform {
-    /**
-     * @brief Max amount of ray bounces before Ray terminates. Higher values result in better graphics.
-     */
-    int         max_ray_bounces {3};
-    /**
-     * @brief Height and Width of view plane. Used for calculating camera rays.
-     */
-    Vec2<float> view_plane      {1, 1};
-    /**
-     * @brief Distance from camera origin to view plane. (=Field of view)
-     */
-    float       distance        {1.0f};
-};
-
 /**
  * @brief Basic light object.
  */
@@ -166,36 +123,98 @@ struct Light : Transform {
     float   distance    {10};
 };
 
+/**
+ * @brief Memory layout of pixels in an Image.
+ */
+enum class ImageLayout {
+    /**
+     * @brief Row by row.
+     */
+    linear,
+    /**
+     * @brief Blocks of Image::block_size x Image::block_size pixels stored one after another (row by row inside of a
+     * block), blocks ordered row by row. A block is exactly one 4 KiB page, so a render tile of the default tile_size
+     * touches one page instead of one per row. Addressing costs a few more instructions per access.
+     */
+    tiled
+};
+
 /**
  * @brief Image. is basically a matrix of colors. Necessary for rendering.
  */
 class Image : public Matrix<Color> {
 protected:
+    size_t          m_width, m_height;
+    ImageLayout     m_layout;
+    /**
+     * @brief Addressing of both layouts without branches (see index()). Linear: m_high = ~0, m_low = 0, m_shift = 0,
+     * m_stride = width. Tiled: m_high = ~(block_size - 1), m_low = block_size - 1, m_shift = block_shift,
+     * m_stride = padded width.
+     */
+    size_t          m_high, m_low, m_shift, m_stride;
 public:
+    /**
+     * @brief Width and height of blocks in tiled layout (16 x 16 colors = 4 KiB).
+     */
+    static constexpr size_t block_shift {4};
+    static constexpr size_t block_size {1 << block_shift};
+
     Image() = delete;
     /**
      * @brief Construct a new Image object.
      * @param width width of image.
      * @param height height of image.
+     * @param layout memory layout of pixels. In tiled layout the size is padded to full blocks internally.
      */
-    Image(const size_t width, const size_t height);
+    Image(const size_t width, const size_t height, ImageLayout layout = ImageLayout::linear);
 
     /**
-     * @brief Output image to .ppm file.
+     * @brief Output image to file. Format depends on extension: .pfm = float HDR, otherwise binary .ppm (P6).
      * @param dest file path (file will be created or overwritten).
      */
     void write(const char* dest) const;
 
+    /**
+     * @brief Copy rows into linear (row-major) order, e.g. for output.
+     * @param first_row first row.
+     * @param count amount of rows.
+     * @param dst destination (count * width colors).
+     */
+    void read_rows(size_t first_row, size_t count, Color* dst) const;
+
+    /**
+     * @brief Get index of pixel in pixel data.
+     * @param x column.
+     * @param y row.
+     * @return size_t index.
+     */
+    inline size_t index(size_t x, size_t y) const noexcept {
+        //Tiled: (first row of block) * stride + (row in block) * block_size + (first column of block) * block_size + column in block.
+        return (y & m_high) * m_stride + ((y & m_low) << m_shift) + ((x & m_high) << m_shift) + (x & m_low);
+    }
+    /**
+     * @brief Get pixel.
+     * @param x column.
+     * @param y row.
+     * @return Color& pixel.
+     */
+    inline Color& operator()(size_t x, size_t y) const noexcept { return m_data[index(x, y)]; }
+
     /**
      * @brief Get width of image.
      * @return const size_t width.
      */
-    inline const size_t width() const { return m_colums; }
+    inline const size_t width() const { return m_width; }
     /**
      * @brief Get height of image.
      * @return const size_t height.
      */
-    inline const size_t height() const { return m_rows; } 
+    inline const size_t height() const { return m_height; } 
+    /**
+     * @brief Get memory layout of pixels.
+     * @return ImageLayout layout.
+     */
+    inline ImageLayout layout() const noexcept { return m_layout; }
 };
 
 struct Renderable;
@@ -214,12 +233,21 @@ struct Intersection {
 };
 
 struct SceneData;
+class BVH;
+class PrimitiveStore;
 
 /**
- * @brief View Vectors of Camera.
+ * @brief What an intersection query along a ray looks for.
  */
-struct View {
-    Vec3<float> ul, ur, ll, lr;
+enum class QueryMode {
+    /**
+     * @brief Find the closest intersection (visible surface).
+     */
+    closest_hit,
+    /**
+     * @brief Find any intersection and stop there (occlusion, e.g. shadows).
+     */
+    any_hit
 };
 
 /**
@@ -246,10 +274,27 @@ struct Ray{
      * @brief closest intersection to the camera --> visible intersection.
      */
     Intersection        m_closest;
+    /**
+     * @brief Distance from start to closest intersection along the ray. Before any intersection is registered,
+     * this is the max distance of the query (t_max). Only intersections closer than this are registered.
+     */
+    float               m_closest_distance {INFINITY};
+    /**
+     * @brief Min distance of the query (t_min). Only intersections farther than this are registered.
+     */
+    float               m_min_distance {0};
+    /**
+     * @brief Closest-hit or any-hit query.
+     */
+    QueryMode           m_mode {QueryMode::closest_hit};
     /**
      * @brief Ignore an object for the next fire iteration. (Could be emitter)
      */
-    Renderable*         m_ignore;
+    Renderable*         m_ignore {nullptr};
+    /**
+     * @brief Ray starts at the camera. Primary rays only test objects inside the view frustum (see SceneData::cull()).
+     */
+    bool                m_primary {false};
 
     /**
      * @brief Construct a new Ray object
@@ -266,11 +311,64 @@ struct Ray{
      */
     Color fire(const SceneData& scene);
 
+    /**
+     * @brief Check for intersections only (= Intersection stage). The closest intersection is registered in the ray.
+     * @param scene scene data.
+     */
+    void cast(const SceneData& scene);
+
+    /**
+     * @brief Process closest registered intersection (= Materialization stage). Used if intersections were
+     * detected elsewhere, e.g. by packet tracing. Bounces are followed iteratively (see Renderable::shade()): Each
+     * bounce adds its color weighted by the product of the weights of all bounces before.
+     * @param scene scene data.
+     * @return Color Result and final color of ray.
+     */
+    Color process(const SceneData& scene);
+
+    /**
+     * @brief Restrict intersection query to an interval along the ray.
+     * @param t_min min distance (exclusive).
+     * @param t_max max distance (exclusive).
+     * @param mode closest-hit or any-hit.
+     */
+    void query(float t_min, float t_max, QueryMode mode = QueryMode::closest_hit);
+
+    /**
+     * @brief Is the query finished? (An any-hit query is finished by its first intersection)
+     * @return true no more intersections have to be checked.
+     */
+    inline bool done() const noexcept { return m_mode == QueryMode::any_hit && m_closest.object; }
+
     /**
      * @brief Register another intersection. Intersection will be automatically filtered.
      * @param inter Intersection-
      */
     void intersection(const Intersection& inter);
+    /**
+     * @brief Register another intersection whose distance along the ray is already known.
+     * @param inter Intersection.
+     * @param distance distance from start to intersection point.
+     */
+    void intersection(const Intersection& inter, float distance);
+};
+
+/**
+ * @brief Continuation of a ray path after a hit (e.g. reflection). Filled by Renderable::shade().
+ */
+struct Bounce {
+    /**
+     * @brief Start point and direction of the next ray.
+     */
+    Vec3<float>     origin, dir;
+    /**
+     * @brief Share of the next ray's color in the color of this hit. 0 ends the path.
+     */
+    float           weight  {0};
+    /**
+     * @brief Object ignored by the next ray (usually the object that was hit).
+     */
+    Renderable*     ignore  {nullptr};
 };
 
 /**
@@ -293,9 +391,15 @@ struct Material {
 class BoundingBox{
 public:
     /**
-     * @brief points a and b defining box.
+     * @brief points a and b defining box. a is the corner with the largest, b with the smallest coordinates.
      */
     Vec3<float> a, b;
+    /**
+     * @brief Construct a new Bounding Box object by its corners.
+     * @param max corner with largest coordinates.
+     * @param min corner with smallest coordinates.
+     */
+    BoundingBox(const Vec3<float>& max, const Vec3<float>& min);
     /**
      * @brief Construct a new Bounding Box object by margins of object (measured from position)
      * 
@@ -308,19 +412,31 @@ public:
      */
     BoundingBox(float x1, float x2, float y1, float y2, float z1, float z2);
     /**
-     * @brief Checks if Geometry is in some camera's view.
+     * @brief Checks if Geometry is in some camera's view (frustum of its primary rays). Conservative: boxes without
+     * finite bounds and boxes close to the border of the frustum are visible.
      * 
      * @param cam Camera.
+     * @param view View of camera for the frame.
      * @return true Bounding box and Geometry inside could be visible to the camera.
      * @return false Bounding box is outside view.
      */
-    bool check_visibility(const Camera& cam, const View& view);
+    bool check_visibility(const Camera& cam, const View& view) const;
     /**
      * @brief Calculate and return vertex points of bounding box.
      * 
      * @return std::array<Vec3<float>, 8> array of vertex positions.
      */
-    inline std::array<Vec3<float>, 8> get_points() noexcept;
+    std::array<Vec3<float>, 8> get_points() const noexcept;
+    /**
+     * @brief Checks if box is finite. Infinite boxes are used by objects without bounds.
+     * @return true all coordinates are finite.
+     */
+    bool is_finite() const noexcept;
+    /**
+     * @brief Box containing everything. Used by objects without bounds.
+     * @return BoundingBox infinite box.
+     */
+    static BoundingBox infinite() noexcept;
 };
 
 /**
@@ -349,6 +465,26 @@ struct Renderable {
      * @return Color Final Color.
      */
     virtual Color process(const SceneData& scene, const Vec3<float>& intersection, const Ray& ray) = 0;
+    /**
+     * @brief Process intersection without following bounces. Used by Ray::process() to trace paths iteratively.
+     * By default process() is called and the path ends here.
+     * @param intersection clostest visible intersection on object.
+     * @param ray ray used for detecting the intersection (For view data).
+     * @param next receives the continuation of the path. Weight stays 0 if the path ends here.
+     * @return Color Color of this hit, excluding the color of the continuation.
+     */
+    virtual Color shade(const SceneData& scene, const Vec3<float>& intersection, const Ray& ray, Bounce& next);
+    /**
+     * @brief Get world space bounds of object. Used by acceleration structures.
+     * @return BoundingBox bounds. Infinite by default (object will be tested by every ray).
+     */
+    virtual BoundingBox bounds() const;
+    /**
+     * @brief Get surface normal at a point on the object.
+     * @param point point on surface.
+     * @return Vec3<float> normalized normal. Zero vector by default (unknown).
+     */
+    virtual Vec3<float> normal_at(const Vec3<float>& point) const;
 };
 
 /**
@@ -361,6 +497,33 @@ struct Sphere : Renderable, Transform{
     float radius {1.0f};
     virtual bool intersect(Ray& ray) override;
     virtual Color process(const SceneData& scene, const Vec3<float>& intersection, const Ray& ray) override;
+    virtual Color shade(const SceneData& scene, const Vec3<float>& intersection, const Ray& ray, Bounce& next) override;
+    virtual BoundingBox bounds() const override;
+    virtual Vec3<float> normal_at(const Vec3<float>& point) const override;
+};
+
+/**
+ * @brief Parts of the scene that changed since the last frame.
+ */
+enum DirtyFlags : uint32_t {
+    dirty_none      = 0,
+    /**
+     * @brief Camera moved or changed (primary rays change).
+     */
+    dirty_camera    = 1 << 0,
+    /**
+     * @brief Objects were added, removed, moved or resized (primary intersections change).
+     */
+    dirty_geometry  = 1 << 1,
+    /**
+     * @brief Lights were added, removed or changed (only shading changes).
+     */
+    dirty_lights    = 1 << 2,
+    /**
+     * @brief Materials changed (only shading changes).
+     */
+    dirty_materials = 1 << 3,
+    dirty_all       = dirty_camera | dirty_geometry | dirty_lights | dirty_materials
 };
 
 /**
@@ -368,13 +531,61 @@ struct Sphere : Renderable, Transform{
  */
 struct SceneData{
     /**
-     * @brief List of objects in the scene / to render.
+     * @brief Objects in the scene / to render.
      */
-    std::list<Renderable*>  m_render_list;
+    std::vector<Renderable*>  m_render_list;
     /**
      * @brief Lights used by the scene.
      */
     std::list<Light*> light_list;
+    /**
+     * @brief Acceleration structure over m_render_list. If nullptr, rays test all objects.
+     */
+    std::shared_ptr<const BVH> m_bvh;
+    /**
+     * @brief m_generation m_bvh has been built for.
+     */
+    size_t m_bvh_generation {0};
+    /**
+     * @brief Objects of m_render_list sorted by type, tested by rays if there is no acceleration structure. Only used
+     * while built for the current m_generation, otherwise rays test all objects through Renderable::intersect.
+     */
+    std::shared_ptr<const PrimitiveStore> m_primitives;
+    /**
+     * @brief Objects inside the view frustum of the current frame, tested by primary rays instead of m_primitives (see
+     * cull()). Reflection and shadow rays still test m_primitives.
+     */
+    std::shared_ptr<const PrimitiveStore> m_primary_primitives;
+    /**
+     * @brief Nodes of m_culled_bvh outside the view frustum of the current frame, skipped by primary rays (see cull()).
+     */
+    std::vector<uint8_t> m_culled_nodes;
+    std::shared_ptr<const BVH> m_culled_bvh;
+    /**
+     * @brief Amount of objects outside the view frustum of the current frame.
+     */
+    size_t m_culled_objects {0};
+    /**
+     * @brief Changes on every add/remove/update. Used to invalidate caches holding object pointers. Values are unique
+     * in the whole process (see next_generation()), so caches also notice when a scene is replaced at the same address.
+     */
+    size_t m_generation {next_generation()};
+    /**
+     * @brief Changes since the last frame (DirtyFlags). Set by add/remove and the update setters, cleared by
+     * Raytracer::render(). Objects, lights and materials changed directly have to be reported with an update setter.
+     */
+    uint32_t m_dirty {dirty_all};
+    /**
+     * @brief Objects and lights allocated in blocks by the scene itself (e.g. by load_scene()). Released with the scene.
+     */
+    std::vector<std::unique_ptr<Sphere[]>>  m_owned_spheres;
+    std::vector<std::unique_ptr<Light[]>>   m_owned_lights;
+
+    /**
+     * @brief Get a new generation value, never returned before in this process.
+     * @return size_t generation.
+     */
+    static size_t next_generation() noexcept;
 
     /**
      * @brief Add renderable object to scene.
@@ -396,8 +607,233 @@ struct SceneData{
      * @param light light.
      */
     void remove(Light* light);
+    /**
+     * @brief Take ownership of a block of spheres and add all of them to the scene.
+     * @param spheres spheres.
+     * @param count amount of spheres.
+     */
+    void adopt(std::unique_ptr<Sphere[]> spheres, size_t count);
+    /**
+     * @brief Take ownership of a block of lights and add all of them to the scene.
+     * @param lights lights.
+     * @param count amount of lights.
+     */
+    void adopt(std::unique_ptr<Light[]> lights, size_t count);
+    /**
+     * @brief Report that an object was moved, resized or its visibility changed.
+     * @param obj renderable object.
+     */
+    void update(Renderable* obj);
+    /**
+     * @brief Report that a light was changed.
+     * @param light light.
+     */
+    void update(Light* light);
+    /**
+     * @brief Set material of an object.
+     * @param obj renderable object.
+     * @param material new material.
+     */
+    void set_material(Renderable* obj, const Material& material);
+    /**
+     * @brief Report other changes, e.g. a material changed directly.
+     * @param flags DirtyFlags.
+     */
+    inline void mark_dirty(uint32_t flags) noexcept { m_dirty |= flags; }
+    /**
+     * @brief (Re-)builds acceleration structure of objects in scene.
+     * @param cache_path if not nullptr, the acceleration structure is loaded from this file if it matches the scene,
+     * otherwise it is built and stored there.
+     */
+    void build_acceleration(const char* cache_path = nullptr);
+    /**
+     * @brief (Re-)builds type-sorted storage of objects in scene (m_primitives).
+     */
+    void build_primitives();
+    /**
+     * @brief Frustum culling: marks nodes of m_bvh that primary rays of a frame can skip (m_culled_nodes), or without
+     * acceleration structure collects objects that primary rays can hit into m_primary_primitives.
+     * @param camera camera of frame.
+     * @param view view of frame.
+     * @return size_t amount of objects culled.
+     */
+    size_t cull(const Camera& camera, const View& view);
+    /**
+     * @brief Get nodes of m_bvh skipped by primary rays of the current frame.
+     * @return const uint8_t* culled nodes, nullptr if cull() has not been called for m_bvh.
+     */
+    inline const uint8_t* culled_nodes() const noexcept {
+        return m_bvh && m_bvh == m_culled_bvh ? m_culled_nodes.data() : nullptr;
+    }
+
+    /**
+     * @brief Checks ray for intersections with visible objects (= Intersection stage), respecting its query
+     * interval and mode.
+     * @param ray Ray.
+     */
+    void intersect(Ray& ray) const;
+    /**
+     * @brief Checks if anything is between a point and a light (any-hit query). Remembers the last occluder per
+     * light and thread and tests it first, since neighboring pixels often share an occluder.
+     * @param point start point.
+     * @param light light.
+     * @param ignore object to ignore (e.g. the surface the point is on).
+     * @return true light is occluded.
+     */
+    bool occluded(const Vec3<float>& point, const Light* light, Renderable* ignore) const;
+};
+
+
+/**
+ * @brief Outcome of a progressive render.
+ */
+struct ProgressiveResult {
+    /**
+     * @brief Pixel step of the finest pass that has been completed (1 = full resolution).
+     */
+    size_t  finest_step         {0};
+    /**
+     * @brief Amount of passes that have been completed.
+     */
+    size_t  completed_passes    {0};
+    /**
+     * @brief Amount of passes needed for the full resolution image.
+     */
+    size_t  total_passes        {0};
+    /**
+     * @brief Amount of traced pixels relative to all pixels of the image (1 = fully refined).
+     */
+    float   progress            {0};
+    /**
+     * @brief Time used in nano-seconds.
+     */
+    double  elapsed             {0};
+};
+
+/**
+ * @brief Sample counts of adaptive supersampling.
+ */
+struct SamplingResult {
+    /**
+     * @brief Amount of pixels in the frame (one base sample each).
+     */
+    size_t  pixels          {0};
+    /**
+     * @brief Amount of pixels that received extra samples.
+     */
+    size_t  refined_pixels  {0};
+    /**
+     * @brief Amount of samples actually traced (base samples + extra samples).
+     */
+    size_t  samples         {0};
+    /**
+     * @brief Amount of samples uniform supersampling with the same per-pixel cap would have traced.
+     */
+    size_t  uniform_samples {0};
+};
+
+/**
+ * @brief Counters of a render. Collected per thread (see current) and merged at the end of Raytracer::render().
+ */
+struct alignas(64) RenderStatistics {
+    /**
+     * @brief Amount of buckets of the bounce histogram. The last bucket also counts deeper rays.
+     */
+    static constexpr size_t max_depth {16};
+
+    /**
+     * @brief Amount of primary rays, reflection rays and shadow rays (occlusion queries).
+     */
+    uint64_t primary_rays       {0};
+    uint64_t reflection_rays    {0};
+    uint64_t shadow_rays        {0};
+    /**
+     * @brief Amount of ray-object intersection tests and how many of them intersected (for packets: lanes with a hit).
+     */
+    uint64_t intersection_tests {0};
+    uint64_t intersection_hits  {0};
+    /**
+     * @brief Amount of rays fired per bounce depth (0 = primary rays).
+     */
+    uint64_t bounce_histogram[max_depth] = {};
+    /**
+     * @brief Amount of objects tested by primary rays and amount of objects culled since they are outside the view
+     * frustum (see SceneData::cull()).
+     */
+    uint64_t primary_candidates {0};
+    uint64_t culled_objects     {0};
+    /**
+     * @brief Time spent in the intersection stage and in the materialization stage of rays (in nano-seconds, summed over
+     * threads). Intersections of reflection rays count as intersection stage, shadow queries as materialization stage.
+     */
+    double   intersection_time  {0};
+    double   materialization_time {0};
+    /**
+     * @brief Wall time of render (in nano-seconds).
+     */
+    double   render_time        {0};
+    /**
+     * @brief Max ray bounces of camera. Used to calculate the depth of rays.
+     */
+    int      max_bounces        {0};
+
+    /**
+     * @brief Statistics the current thread counts into. nullptr = nothing is counted.
+     */
+    static thread_local RenderStatistics* current;
+
+    /**
+     * @brief Add counters of another thread.
+     * @param other statistics.
+     */
+    void merge(const RenderStatistics& other) noexcept;
+    /**
+     * @brief Write statistics as JSON object.
+     * @param stream output stream.
+     */
+    void write_json(std::ostream& stream) const;
+};
+
+/**
+ * @brief Cost of rendering a pixel (all its samples). Recorded by render() if Raytracer::record_cost is set.
+ */
+struct PixelCost {
+    /**
+     * @brief Ray-object intersection tests (including shadow rays).
+     */
+    uint32_t intersection_tests {0};
+    /**
+     * @brief Rays spawned by reflections.
+     */
+    uint32_t reflection_rays    {0};
+    /**
+     * @brief Cycles spent (see cycle_count()).
+     */
+    uint64_t cycles             {0};
 };
 
+/**
+ * @brief Value of PixelCost shown by a heatmap.
+ */
+enum class CostMetric {
+    intersection_tests,
+    reflection_rays,
+    cycles
+};
+
+/**
+ * @brief Data of the primary intersection of a pixel. Allows shading again without tracing primary rays.
+ */
+struct GBufferEntry {
+    /**
+     * @brief Intersection point.
+     */
+    Vec3<float> point;
+    /**
+     * @brief Intersected object. nullptr if the primary ray hit nothing.
+     */
+    Renderable* object {nullptr};
+};
 
 /**
  * @brief Central raytracing unit.
@@ -409,6 +845,39 @@ protected:
      * @brief Image in which the result will be saved. Cannot be null.
      */
     Image*              m_img;
+    /**
+     * @brief Width and height of the frame currently rendered (in pixels).
+     */
+    size_t              m_width {0}, m_height {0};
+    /**
+     * @brief Samples of the last render().
+     */
+    SamplingResult      m_sampling;
+    /**
+     * @brief Statistics of the last render().
+     */
+    RenderStatistics    m_statistics;
+    /**
+     * @brief Statistics per worker of the current render().
+     */
+    std::vector<RenderStatistics> m_worker_statistics;
+    /**
+     * @brief Cost per pixel of the last render() (empty unless record_cost is set).
+     */
+    std::vector<PixelCost> m_pixel_cost;
+    /**
+     * @brief Primary intersections of the last render(), one per pixel of the image.
+     */
+    std::vector<GBufferEntry> m_gbuffer;
+    /**
+     * @brief Settings the image and G-buffer were rendered with. Used to detect changes to the camera.
+     */
+    struct {
+        bool    valid               {false};
+        Camera  camera;
+        size_t  max_samples         {0};
+        float   contrast_threshold  {0};
+    }                   m_frame;
 public:
     /**
      * @brief Current Scene data.
@@ -418,6 +887,55 @@ public:
      * @brief Currently used camera.
      */
     Camera camera;
+    /**
+     * @brief Amount of render threads. 0 = amount of hardware threads.
+     */
+    size_t thread_count {0};
+    /**
+     * @brief Width and height of tiles (in pixels) the image is split into for parallel rendering.
+     */
+    size_t tile_size    {16};
+    /**
+     * @brief If true, a BVH is built at the start of each render. Otherwise rays test all objects.
+     */
+    bool use_acceleration {true};
+    /**
+     * @brief Width and height of pixel blocks whose primary rays are traced together as packet (4 or 8).
+     * 0 = trace every primary ray on its own. Packets require the BVH and are only used if all objects are spheres.
+     */
+    size_t packet_size {4};
+    /**
+     * @brief If not 0, render() traces tiles of wavefront_tile x wavefront_tile pixels in wavefront mode (see
+     * render_tile_wavefront()) instead of tile_size tiles. Larger tiles give longer queues per bounce.
+     */
+    size_t wavefront_tile {0};
+    /**
+     * @brief Path of cache file for the BVH (see BVH::BVH()). Empty = BVH is always built.
+     */
+    std::string acceleration_cache;
+    /**
+     * @brief If true, render() collects statistics (see statistics()). Costs clock reads per ray.
+     */
+    bool collect_statistics {false};
+    /**
+     * @brief If not empty, render() writes statistics as JSON to this file.
+     */
+    std::string statistics_file;
+    /**
+     * @brief Diagnostic mode: render() records the cost of every pixel (see pixel_cost() and write_heatmap()). Primary
+     * rays are traced one by one then (no packets) and the frame is always traced completely.
+     */
+    bool record_cost {false};
+    /**
+     * @brief Max amount of samples per pixel for anti-aliasing. 1 = one ray per pixel (no anti-aliasing).
+     * Only pixels whose brightness differs from a neighbour by more than contrast_threshold get extra samples.
+     */
+    size_t max_samples {1};
+    /**
+     * @brief Brightness difference to a neighbouring pixel (0..1) above which a pixel is supersampled. Sampling a
+     * pixel stops early if the standard deviation of its samples' brightness is below half of this threshold.
+     */
+    float contrast_threshold {0.1f};
 
     Raytracer() = delete;
     /**
@@ -427,9 +945,126 @@ public:
     Raytracer(Image* img);
 
     /**
-     * @brief renders the scene and stores data in image.
+     * @brief renders the scene and stores data in image. Primary intersections are kept in a G-buffer: if only lights
+     * or materials changed since the last call (see SceneData::m_dirty), pixels are just shaded again. If nothing
+     * changed, the image is kept.
      */
     void render();
+
+    /**
+     * @brief Samples of the last render() (adaptive supersampling).
+     */
+    const SamplingResult& sampling() const { return m_sampling; }
+    /**
+     * @brief Statistics of the last render() (if collect_statistics is set).
+     */
+    const RenderStatistics& statistics() const { return m_statistics; }
+    /**
+     * @brief Cost per pixel of the last render() (row-major, empty unless record_cost was set).
+     */
+    const std::vector<PixelCost>& pixel_cost() const { return m_pixel_cost; }
+    /**
+     * @brief Writes cost per pixel of the last render() as false-color image (black = cheap, blue, red, yellow,
+     * white = at least the 99th percentile of the frame).
+     * @param dest file path (see Image::write()).
+     * @param metric shown value.
+     */
+    void write_heatmap(const char* dest, CostMetric metric = CostMetric::intersection_tests) const;
+
+    /**
+     * @brief Renders the scene progressively within a time budget. A coarse pass traces every coarse_step-th pixel
+     * in both directions and fills its block; every following pass halves the step until full resolution.
+     * The coarse pass is always finished. Later passes stop at the deadline (checked per tile), so the image
+     * always holds the best result available.
+     * @param budget time budget in milli-seconds.
+     * @param coarse_step pixel step of the first pass (rounded to a power of 2).
+     * @return ProgressiveResult how far refinement got.
+     */
+    ProgressiveResult render_progressive(double budget, size_t coarse_step = 8);
+
+    /**
+     * @brief Receives finished bands of a streamed render.
+     * @param first_row first row of band in frame.
+     * @param rows amount of rows in band.
+     * @param pixels row-major pixels of band (rows * width colors). Only valid during the call.
+     */
+    using BandSink = std::function<void(size_t first_row, size_t rows, const Color* pixels)>;
+
+    /**
+     * @brief Renders the scene band by band without keeping the whole frame in memory (the image of the Raytracer
+     * is not used). Bands are rendered in parallel, but passed to the sink strictly top to bottom and from
+     * one thread at a time. If the sink throws, no more bands are passed to it and the exception is rethrown once
+     * all bands in flight are finished.
+     * @param width width of frame.
+     * @param height height of frame.
+     * @param sink receives finished bands.
+     * @param band_height rows per band.
+     * @param max_bands_in_flight max amount of bands being rendered or waiting for earlier bands. Peak memory is
+     * about max_bands_in_flight * band_height * width colors. 0 = twice the amount of threads.
+     */
+    void render_stream(size_t width, size_t height, const BandSink& sink, size_t band_height = 16, size_t max_bands_in_flight = 0);
+
+    /**
+     * @brief Streams a render directly into a file (see render_stream() and Image::write()).
+     * @param dest file path (file will be created or overwritten).
+     * @param width width of frame.
+     * @param height height of frame.
+     * @param band_height rows per band.
+     * @param max_bands_in_flight max amount of bands in memory.
+     */
+    void render_to_file(const char* dest, size_t width, size_t height, size_t band_height = 16, size_t max_bands_in_flight = 0);
+
+protected:
+    /**
+     * @brief Builds acceleration structure and calculates view vectors for the next frame.
+     * @param width width of frame.
+     * @param height height of frame.
+     * @param build if false, an existing acceleration structure is kept if it has been built for the current
+     * SceneData::m_generation.
+     * @return View view vectors of camera.
+     */
+    View prepare_frame(size_t width, size_t height, bool build);
+    /**
+     * @brief Renders a rectangular section of the frame.
+     * @param view view vectors of camera.
+     * @param target image receiving the pixels. Pixel (x, y) of the frame is stored at (x, y - row_offset).
+     * @param row_offset first row of frame stored in target.
+     * @param x0 first column.
+     * @param y0 first row.
+     * @param x1 column after last column.
+     * @param y1 row after last row.
+     * @param gbuffer if not nullptr, receives primary intersections. Pixel (x, y) is stored at (y - row_offset) * width + x.
+     * @param cost if not nullptr, receives cost of pixels (stored like gbuffer). Requires statistics of the worker.
+     */
+    void render_tile(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer = nullptr, PixelCost* cost = nullptr);
+    /**
+     * @brief Renders a rectangular section of the frame, tracing primary rays of packet_size x packet_size blocks together.
+     * Parameters like render_tile().
+     */
+    void render_tile_packets(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer = nullptr);
+    /**
+     * @brief Renders a rectangular section of the frame bounce by bounce (wavefront): All rays of a bounce are queued,
+     * intersected together, sorted by material and materialized in that order, producing the queue of the next bounce.
+     * Parameters like render_tile().
+     */
+    void render_tile_wavefront(const View& view, Image& target, size_t row_offset, size_t x0, size_t y0, size_t x1, size_t y1, GBufferEntry* gbuffer = nullptr);
+    /**
+     * @brief Shades all pixels of the image again using the primary intersections in the G-buffer (no primary rays).
+     * @param view view vectors of camera.
+     */
+    void shade(const View& view);
+    /**
+     * @brief Get statistics a worker of the current render() counts into.
+     * @param worker index of worker.
+     * @return RenderStatistics* statistics. nullptr if statistics are disabled.
+     */
+    RenderStatistics* worker_statistics(size_t worker) noexcept;
+    /**
+     * @brief Adds samples to pixels of the rendered image with high contrast to their neighbours (max_samples per pixel).
+     * @param view view vectors of camera.
+     * @return SamplingResult amount of samples spent.
+     */
+    SamplingResult supersample(const View& view);
 };
 
 void display(const Image* img);
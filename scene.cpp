@@ -0,0 +1,304 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "scene.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * @brief Sphere statement. The material is referenced by name (pointing into the file buffer) until all
+ * materials are known.
+ */
+struct SphereRecord {
+    Vec3<float> pos;
+    float       radius;
+    const char* material;
+    uint32_t    material_length;
+    uint32_t    line;
+};
+
+/**
+ * @brief Statements of a chunk of the scene file.
+ */
+struct SceneChunk {
+    const char*                                 begin {nullptr};
+    const char*                                 end {nullptr};
+    std::vector<SphereRecord>                   spheres;
+    std::vector<Light>                          lights;
+    std::vector<std::pair<std::string, Material>> materials;
+    bool                                        has_camera {false}, has_image {false};
+    Camera                                      camera;
+    size_t                                      width {0}, height {0};
+    /**
+     * @brief Amount of lines in chunk (to calculate line numbers of errors).
+     */
+    size_t                                      lines {0};
+    const char*                                 error {nullptr};
+    size_t                                      error_line {0};
+};
+
+/**
+ * @brief Tokenizer of a single line.
+ */
+struct LineReader {
+    const char* p;
+    const char* end;
+
+    static inline bool is_space(char c) noexcept { return c == ' ' || c == '\t' || c == '\r'; }
+
+    /**
+     * @brief Get next token of line.
+     * @param token_end end of token.
+     * @return const char* start of token. nullptr if line has no more tokens.
+     */
+    inline const char* token(const char*& token_end) noexcept {
+        while(p < end && is_space(*p)) p++;
+        if(p == end || *p == '#') return nullptr;
+        const char* start = p;
+        while(p < end && !is_space(*p) && *p != '#') p++;
+        token_end = p;
+        return start;
+    }
+
+    inline bool number(float& f) noexcept {
+        const char* token_end;
+        const char* start = token(token_end);
+        if(!start) return false;
+        char* number_end;
+        f = std::strtof(start, &number_end);
+        return number_end == token_end;
+    }
+
+    inline bool vec(Vec3<float>& v) noexcept {
+        return number(v.x) && number(v.y) && number(v.z);
+    }
+
+    inline bool color(Color& c) noexcept {
+        return number(c.r) && number(c.g) && number(c.b);
+    }
+
+    inline bool empty() noexcept {
+        const char* token_end;
+        return token(token_end) == nullptr;
+    }
+};
+
+static inline bool keyword(const char* start, const char* end, const char* word) noexcept {
+    size_t length = std::strlen(word);
+    return (size_t)(end - start) == length && std::memcmp(start, word, length) == 0;
+}
+
+/**
+ * @brief Parses one statement.
+ * @return const char* error message or nullptr.
+ */
+static const char* parse_statement(LineReader& line, SceneChunk& chunk){
+    const char* word_end;
+    const char* word = line.token(word_end);
+    if(!word) return nullptr;
+
+    if(keyword(word, word_end, "sphere")){
+        SphereRecord record;
+        if(!line.vec(record.pos) || !line.number(record.radius) || !std::isfinite(record.radius) || record.radius <= 0)
+            return "Invalid sphere statement.";
+        const char* name_end;
+        record.material = line.token(name_end);
+        record.material_length = record.material ? (uint32_t)(name_end - record.material) : 0;
+        record.line = (uint32_t)chunk.lines;
+        chunk.spheres.push_back(record);
+    } else if(keyword(word, word_end, "light")){
+        Light light;
+        if(!line.vec(light.pos) || !line.color(light.color) || !line.number(light.intensity) || !line.number(light.distance))
+            return "Invalid light statement.";
+        chunk.lights.push_back(light);
+    } else if(keyword(word, word_end, "material")){
+        const char* name_end;
+        const char* name = line.token(name_end);
+        Material material;
+        if(!name || !line.color(material.base_color) || !line.number(material.diffuseness)) return "Invalid material statement.";
+        chunk.materials.emplace_back(std::string(name, name_end), material);
+    } else if(keyword(word, word_end, "camera")){
+        Camera camera;
+        if(!line.vec(camera.pos) || !line.vec(camera.rot)) return "Invalid camera statement.";
+        //Optional view settings.
+        LineReader rest = line;
+        float bounces;
+        if(rest.number(camera.view_plane.x)){
+            if(!rest.number(camera.view_plane.y) || !rest.number(camera.distance) || !rest.number(bounces) || bounces < 0)
+                return "Invalid camera statement.";
+            camera.max_ray_bounces = (int)bounces;
+            line = rest;
+            //Optional projection.
+            const char* projection_end;
+            const char* projection = rest.token(projection_end);
+            if(projection){
+                if(keyword(projection, projection_end, "orthographic"))     camera.projection = Projection::orthographic;
+                else if(!keyword(projection, projection_end, "pinhole"))    return "Invalid camera statement.";
+                line = rest;
+            }
+        }
+        chunk.camera = camera;
+        chunk.has_camera = true;
+    } else if(keyword(word, word_end, "image")){
+        float width, height;
+        if(!line.number(width) || !line.number(height) || width < 1 || height < 1) return "Invalid image statement.";
+        chunk.width = (size_t)width;
+        chunk.height = (size_t)height;
+        chunk.has_image = true;
+    } else return "Unknown statement.";
+
+    if(!line.empty()) return "Too many values in statement.";
+    return nullptr;
+}
+
+static void parse_chunk(SceneChunk& chunk){
+    const char* p = chunk.begin;
+    while(p < chunk.end){
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', chunk.end - p));
+        if(!eol) eol = chunk.end;
+        LineReader line {p, eol};
+        const char* error = parse_statement(line, chunk);
+        if(error){
+            chunk.error = error;
+            chunk.error_line = chunk.lines;
+            return;
+        }
+        chunk.lines++;
+        p = eol + 1;
+    }
+}
+
+/**
+ * @brief Reads whole file into memory.
+ */
+static std::vector<char> read_file(const char* path){
+    FILE* file = std::fopen(path, "rb");
+    if(!file) throw "Cannot open scene file.";
+    std::vector<char> data(1 << 20);
+    size_t size = 0;
+    while(true){
+        size += std::fread(data.data() + size, 1, data.size() - size, file);
+        if(size < data.size()) break;
+        data.resize(data.size() * 2);
+    }
+    bool failed = std::ferror(file);
+    std::fclose(file);
+    if(failed) throw "Cannot read scene file.";
+    data.resize(size);
+    return data;
+}
+
+SceneFileInfo load_scene(const char* path, SceneData& scene, Camera& camera){
+    if(!path) throw "Cannot load scene from nullptr path.";
+    ProfileZone zone("load scene", "setup");
+    const std::vector<char> data = read_file(path);
+    const char* begin = data.data();
+    const char* end = begin + data.size();
+
+    //1. Split file into chunks at line ends and parse them in parallel.
+    work_stealing_scheduler scheduler;
+    const size_t min_chunk_size = 1 << 16;
+    size_t chunk_count = std::max<size_t>(1, std::min(scheduler.thread_count() * 8, data.size() / min_chunk_size));
+    std::vector<SceneChunk> chunks;
+    chunks.reserve(chunk_count);
+    const char* chunk_begin = begin;
+    for(size_t i = 1; i <= chunk_count && chunk_begin < end; i++){
+        const char* chunk_end = i == chunk_count ? end : begin + data.size() * i / chunk_count;
+        if(chunk_end < chunk_begin) chunk_end = chunk_begin;
+        const char* eol = static_cast<const char*>(std::memchr(chunk_end, '\n', end - chunk_end));
+        chunk_end = eol ? eol + 1 : end;
+        SceneChunk chunk;
+        chunk.begin = chunk_begin;
+        chunk.end = chunk_end;
+        chunks.push_back(std::move(chunk));
+        chunk_begin = chunk_end;
+    }
+    scheduler.run(chunks.size(), [&](size_t index, size_t){
+        ProfileZone chunk_zone("parse chunk", "setup", index);
+        parse_chunk(chunks[index]);
+    });
+
+    //2. Merge: report first error, collect materials, camera and image (the last statement wins).
+    SceneFileInfo info;
+    std::unordered_map<std::string, Material> materials;
+    size_t line_offset = 0;
+    std::vector<size_t> sphere_offsets(chunks.size()), light_offsets(chunks.size());
+    size_t sphere_count = 0, light_count = 0;
+    for(size_t i = 0; i < chunks.size(); i++){
+        SceneChunk& chunk = chunks[i];
+        if(chunk.error){
+            std::cerr << path << ":" << (line_offset + chunk.error_line + 1) << ": " << chunk.error << std::endl;
+            throw chunk.error;
+        }
+        for(auto& material : chunk.materials)
+            if(!materials.emplace(material.first, material.second).second){
+                std::cerr << path << ": material '" << material.first << "'" << std::endl;
+                throw "Material defined more than once in scene file.";
+            }
+        if(chunk.has_camera) camera = chunk.camera;
+        if(chunk.has_image){
+            info.width = chunk.width;
+            info.height = chunk.height;
+        }
+        sphere_offsets[i] = sphere_count;
+        light_offsets[i] = light_count;
+        sphere_count += chunk.spheres.size();
+        light_count += chunk.lights.size();
+        chunk.error_line = line_offset;
+        line_offset += chunk.lines;
+    }
+
+    //3. Allocate objects in bulk and fill them in parallel.
+    std::unique_ptr<Sphere[]> spheres(new Sphere[sphere_count]);
+    std::unique_ptr<Light[]> lights(new Light[light_count]);
+    scheduler.run(chunks.size(), [&](size_t index, size_t){
+        ProfileZone chunk_zone("create objects", "setup", index);
+        SceneChunk& chunk = chunks[index];
+        //Consecutive spheres often share their material.
+        const char* last_name = nullptr;
+        uint32_t last_length = 0;
+        Material last_material;
+        for(size_t i = 0; i < chunk.spheres.size(); i++){
+            const SphereRecord& record = chunk.spheres[i];
+            Sphere& sphere = spheres[sphere_offsets[index] + i];
+            sphere.pos = record.pos;
+            sphere.radius = record.radius;
+            if(!record.material) continue;
+            if(!last_name || last_length != record.material_length || std::memcmp(last_name, record.material, last_length) != 0){
+                auto material = materials.find(std::string(record.material, record.material_length));
+                if(material == materials.end()){
+                    chunk.error = "Unknown material in scene file.";
+                    chunk.error_line += record.line;
+                    return;
+                }
+                last_name = record.material;
+                last_length = record.material_length;
+                last_material = material->second;
+            }
+            sphere.material = last_material;
+        }
+        std::copy(chunk.lights.begin(), chunk.lights.end(), lights.get() + light_offsets[index]);
+    });
+    for(SceneChunk& chunk : chunks)
+        if(chunk.error){
+            std::cerr << path << ":" << (chunk.error_line + 1) << ": " << chunk.error << std::endl;
+            throw chunk.error;
+        }
+
+    //4. Hand objects over to scene.
+    info.spheres = sphere_count;
+    info.lights = light_count;
+    info.materials = materials.size();
+    scene.adopt(std::move(spheres), sphere_count);
+    scene.adopt(std::move(lights), light_count);
+    return info;
+}
@@ -0,0 +1,47 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "raytracer.h"
+
+/*
+ * Scene file format (text, one statement per line, '#' starts a comment, values separated by spaces or tabs):
+ *
+ *  image    <width> <height>
+ *  camera   <x> <y> <z> <rot x> <rot y> <rot z> [<view plane width> <view plane height> <distance> <max bounces> [pinhole|orthographic]]
+ *  material <name> <r> <g> <b> <diffuseness>
+ *  sphere   <x> <y> <z> <radius> [<material name>]
+ *  light    <x> <y> <z> <r> <g> <b> <intensity> <distance>
+ *
+ * Rotations are in degrees (applied around z, then y, then x). Colors are in [0, 1]. Materials may be defined anywhere in the file (also after the spheres using them), names must
+ * be unique. Spheres without material use the default Material. If image or camera appear more than once, the last
+ * one wins. See demo.scene for an example.
+ */
+
+/**
+ * @brief Information about a loaded scene file.
+ */
+struct SceneFileInfo {
+    /**
+     * @brief Size of image to render (500x500 if not set by the file).
+     */
+    size_t width {500}, height {500};
+    /**
+     * @brief Amount of loaded objects.
+     */
+    size_t spheres {0}, lights {0}, materials {0};
+};
+
+/**
+ * @brief Loads a scene file. The file is parsed in parallel chunks, objects are allocated in one block per type and
+ * are owned by the scene (see SceneData::adopt()).
+ * @param path path to scene file.
+ * @param scene scene receiving objects and lights.
+ * @param camera camera, overwritten if the file contains a camera statement.
+ * @return SceneFileInfo image size and amount of objects.
+ */
+SceneFileInfo load_scene(const char* path, SceneData& scene, Camera& camera);
@@ -0,0 +1,260 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#include "simd.h"
+#include <algorithm>
+
+#ifdef RAYTRACER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+void SphereSoA::resize(size_t count){
+    const size_t stride = count + padding;
+    m_storage.assign(data_size(count), 0);
+    std::fill(m_storage.begin() + 3 * stride, m_storage.end(), NAN);
+    view(m_storage.data(), count);
+}
+
+void SphereSoA::view(const float* data, size_t count){
+    const size_t stride = count + padding;
+    x = data;
+    y = data + stride;
+    z = data + 2 * stride;
+    r2 = data + 3 * stride;
+    m_count = count;
+}
+
+void SphereSoA::set(size_t index, const Vec3<float>& center, float radius){
+    const size_t stride = m_count + padding;
+    m_storage[index] = center.x;
+    m_storage[stride + index] = center.y;
+    m_storage[2 * stride + index] = center.z;
+    m_storage[3 * stride + index] = radius * radius;
+}
+
+void RayPacket::set(size_t lane, const Vec3<float>& start, const Vec3<float>& dir) noexcept {
+    ox[lane] = start.x; oy[lane] = start.y; oz[lane] = start.z;
+    dx[lane] = dir.x; dy[lane] = dir.y; dz[lane] = dir.z;
+    update(lane);
+}
+
+void RayPacket::update(size_t lane) noexcept {
+    ix[lane] = 1.0f / dx[lane]; iy[lane] = 1.0f / dy[lane]; iz[lane] = 1.0f / dz[lane];
+    t[lane] = INFINITY;
+    hit[lane] = UINT32_MAX;
+}
+
+void RayPacket::disable(size_t lane) noexcept {
+    set(lane, {0, 0, 0}, {1, 0, 0});
+    t[lane] = -1;
+}
+
+uint32_t intersect_spheres_scalar(const SphereSoA& s, size_t first, size_t count,
+                                  const Vec3<float>& start, const Vec3<float>& dir, float t_min, float t_max, float* t){
+    uint32_t mask = 0;
+    for(size_t i = 0; i < count; i++){
+        size_t j = first + i;
+        Vec3<float> oc = {s.x[j] - start.x, s.y[j] - start.y, s.z[j] - start.z};
+        t[i] = intersect_sphere(oc, dir, s.r2[j], t_min);
+        if(t[i] < t_max) mask |= 1u << i;
+    }
+    return mask;
+}
+
+#ifdef RAYTRACER_X86
+
+uint32_t intersect_spheres_sse(const SphereSoA& s, size_t first, size_t count,
+                               const Vec3<float>& start, const Vec3<float>& dir, float t_min, float t_max, float* t){
+    const __m128 ox = _mm_set1_ps(start.x), oy = _mm_set1_ps(start.y), oz = _mm_set1_ps(start.z);
+    const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+    const __m128 zero = _mm_setzero_ps(), inf = _mm_set1_ps(INFINITY), tmin = _mm_set1_ps(t_min), tmax = _mm_set1_ps(t_max);
+    uint32_t mask = 0;
+    for(size_t i = 0; i < count; i += 4){
+        size_t j = first + i;
+        __m128 cx = _mm_sub_ps(_mm_loadu_ps(&s.x[j]), ox);
+        __m128 cy = _mm_sub_ps(_mm_loadu_ps(&s.y[j]), oy);
+        __m128 cz = _mm_sub_ps(_mm_loadu_ps(&s.z[j]), oz);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, dx), _mm_mul_ps(cy, dy)), _mm_mul_ps(cz, dz));
+        __m128 lx = _mm_sub_ps(cx, _mm_mul_ps(dx, b)), ly = _mm_sub_ps(cy, _mm_mul_ps(dy, b)), lz = _mm_sub_ps(cz, _mm_mul_ps(dz, b));
+        __m128 disc = _mm_sub_ps(_mm_loadu_ps(&s.r2[j]), _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)));
+        __m128 valid = _mm_cmpge_ps(disc, zero);
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 t0 = _mm_sub_ps(b, root), t1 = _mm_add_ps(b, root);
+        //Nearest root: t0 if farther than t_min, else t1 if farther than t_min, else infinity.
+        __m128 front0 = _mm_cmpgt_ps(t0, tmin), front1 = _mm_cmpgt_ps(t1, tmin);
+        __m128 r = _mm_or_ps(_mm_and_ps(front1, t1), _mm_andnot_ps(front1, inf));
+        r = _mm_or_ps(_mm_and_ps(front0, t0), _mm_andnot_ps(front0, r));
+        r = _mm_or_ps(_mm_and_ps(valid, r), _mm_andnot_ps(valid, inf));
+
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, r);
+        uint32_t hits = (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(r, tmax));
+        size_t n = count - i < 4 ? count - i : 4;
+        for(size_t l = 0; l < n; l++) t[i + l] = lanes[l];
+        mask |= (hits & ((1u << n) - 1)) << i;
+    }
+    return mask;
+}
+
+TARGET_AVX uint32_t intersect_spheres_avx(const SphereSoA& s, size_t first, size_t count,
+                                          const Vec3<float>& start, const Vec3<float>& dir, float t_min, float t_max, float* t){
+    const __m256 ox = _mm256_set1_ps(start.x), oy = _mm256_set1_ps(start.y), oz = _mm256_set1_ps(start.z);
+    const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+    const __m256 zero = _mm256_setzero_ps(), inf = _mm256_set1_ps(INFINITY), tmin = _mm256_set1_ps(t_min), tmax = _mm256_set1_ps(t_max);
+    uint32_t mask = 0;
+    for(size_t i = 0; i < count; i += 8){
+        size_t j = first + i;
+        __m256 cx = _mm256_sub_ps(_mm256_loadu_ps(&s.x[j]), ox);
+        __m256 cy = _mm256_sub_ps(_mm256_loadu_ps(&s.y[j]), oy);
+        __m256 cz = _mm256_sub_ps(_mm256_loadu_ps(&s.z[j]), oz);
+        //No FMA: same rounding as the scalar and SSE kernels, so results don't depend on the selected kernel.
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, dx), _mm256_mul_ps(cy, dy)), _mm256_mul_ps(cz, dz));
+        __m256 lx = _mm256_sub_ps(cx, _mm256_mul_ps(dx, b)), ly = _mm256_sub_ps(cy, _mm256_mul_ps(dy, b)), lz = _mm256_sub_ps(cz, _mm256_mul_ps(dz, b));
+        __m256 disc = _mm256_sub_ps(_mm256_loadu_ps(&s.r2[j]), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz)));
+        __m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+        __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+        __m256 t0 = _mm256_sub_ps(b, root), t1 = _mm256_add_ps(b, root);
+        //Nearest root: t0 if farther than t_min, else t1 if farther than t_min, else infinity.
+        __m256 r = _mm256_blendv_ps(inf, t1, _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ));
+        r = _mm256_blendv_ps(r, t0, _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ));
+        r = _mm256_blendv_ps(inf, r, valid);
+
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, r);
+        uint32_t hits = (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(r, tmax, _CMP_LT_OQ));
+        size_t n = count - i < 8 ? count - i : 8;
+        for(size_t l = 0; l < n; l++) t[i + l] = lanes[l];
+        mask |= (hits & ((1u << n) - 1)) << i;
+    }
+    return mask;
+}
+
+bool intersect_box_packet(const RayPacket& p, const Vec3<float>& min, const Vec3<float>& max, float& t_near){
+    const __m128 minx = _mm_set1_ps(min.x), miny = _mm_set1_ps(min.y), minz = _mm_set1_ps(min.z);
+    const __m128 maxx = _mm_set1_ps(max.x), maxy = _mm_set1_ps(max.y), maxz = _mm_set1_ps(max.z);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 nearest = _mm_set1_ps(INFINITY);
+    int any = 0;
+    for(size_t i = 0; i < p.size; i += 4){
+        __m128 ox = _mm_load_ps(&p.ox[i]), oy = _mm_load_ps(&p.oy[i]), oz = _mm_load_ps(&p.oz[i]);
+        __m128 ix = _mm_load_ps(&p.ix[i]), iy = _mm_load_ps(&p.iy[i]), iz = _mm_load_ps(&p.iz[i]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(minx, ox), ix), t1 = _mm_mul_ps(_mm_sub_ps(maxx, ox), ix);
+        __m128 near = _mm_max_ps(zero, _mm_min_ps(t0, t1)), far = _mm_min_ps(_mm_load_ps(&p.t[i]), _mm_max_ps(t0, t1));
+        t0 = _mm_mul_ps(_mm_sub_ps(miny, oy), iy); t1 = _mm_mul_ps(_mm_sub_ps(maxy, oy), iy);
+        near = _mm_max_ps(near, _mm_min_ps(t0, t1)); far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+        t0 = _mm_mul_ps(_mm_sub_ps(minz, oz), iz); t1 = _mm_mul_ps(_mm_sub_ps(maxz, oz), iz);
+        near = _mm_max_ps(near, _mm_min_ps(t0, t1)); far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+        __m128 hit = _mm_cmple_ps(near, far);
+        any |= _mm_movemask_ps(hit);
+        nearest = _mm_min_ps(nearest, _mm_or_ps(_mm_and_ps(hit, near), _mm_andnot_ps(hit, _mm_set1_ps(INFINITY))));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, nearest);
+    t_near = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    return any != 0;
+}
+
+void intersect_sphere_packet(RayPacket& p, float x, float y, float z, float r2, uint32_t index){
+    const __m128 cx = _mm_set1_ps(x), cy = _mm_set1_ps(y), cz = _mm_set1_ps(z), rr = _mm_set1_ps(r2);
+    const __m128 zero = _mm_setzero_ps(), inf = _mm_set1_ps(INFINITY);
+    const __m128i id = _mm_set1_epi32((int)index);
+    for(size_t i = 0; i < p.size; i += 4){
+        __m128 ocx = _mm_sub_ps(cx, _mm_load_ps(&p.ox[i]));
+        __m128 ocy = _mm_sub_ps(cy, _mm_load_ps(&p.oy[i]));
+        __m128 ocz = _mm_sub_ps(cz, _mm_load_ps(&p.oz[i]));
+        __m128 dx = _mm_load_ps(&p.dx[i]), dy = _mm_load_ps(&p.dy[i]), dz = _mm_load_ps(&p.dz[i]);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 lx = _mm_sub_ps(ocx, _mm_mul_ps(dx, b)), ly = _mm_sub_ps(ocy, _mm_mul_ps(dy, b)), lz = _mm_sub_ps(ocz, _mm_mul_ps(dz, b));
+        __m128 disc = _mm_sub_ps(rr, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)));
+        __m128 valid = _mm_cmpge_ps(disc, zero);
+        if(!_mm_movemask_ps(valid)) continue;
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 t0 = _mm_sub_ps(b, root), t1 = _mm_add_ps(b, root);
+        __m128 front0 = _mm_cmpgt_ps(t0, zero), front1 = _mm_cmpgt_ps(t1, zero);
+        __m128 r = _mm_or_ps(_mm_and_ps(front1, t1), _mm_andnot_ps(front1, inf));
+        r = _mm_or_ps(_mm_and_ps(front0, t0), _mm_andnot_ps(front0, r));
+        __m128 current = _mm_load_ps(&p.t[i]);
+        __m128 closer = _mm_and_ps(valid, _mm_cmplt_ps(r, current));
+        _mm_store_ps(&p.t[i], _mm_or_ps(_mm_and_ps(closer, r), _mm_andnot_ps(closer, current)));
+        __m128i hit = _mm_loadu_si128((const __m128i*)&p.hit[i]);
+        __m128i mask = _mm_castps_si128(closer);
+        _mm_storeu_si128((__m128i*)&p.hit[i], _mm_or_si128(_mm_and_si128(mask, id), _mm_andnot_si128(mask, hit)));
+    }
+}
+
+bool cpu_supports_avx(){
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool avx = (info[2] & (1 << 28)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    return avx && osxsave && (_xgetbv(0) & 6) == 6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+#endif
+}
+
+static sphere_kernel select_sphere_kernel(){
+    return cpu_supports_avx() ? intersect_spheres_avx : intersect_spheres_sse;
+}
+
+#else
+
+bool intersect_box_packet(const RayPacket& p, const Vec3<float>& min, const Vec3<float>& max, float& t_near){
+    bool any = false;
+    t_near = INFINITY;
+    for(size_t i = 0; i < p.size; i++){
+        float t0 = (min.x - p.ox[i]) * p.ix[i], t1 = (max.x - p.ox[i]) * p.ix[i];
+        float near = std::max(0.0f, std::min(t0, t1)), far = std::min(p.t[i], std::max(t0, t1));
+        t0 = (min.y - p.oy[i]) * p.iy[i]; t1 = (max.y - p.oy[i]) * p.iy[i];
+        near = std::max(near, std::min(t0, t1)); far = std::min(far, std::max(t0, t1));
+        t0 = (min.z - p.oz[i]) * p.iz[i]; t1 = (max.z - p.oz[i]) * p.iz[i];
+        near = std::max(near, std::min(t0, t1)); far = std::min(far, std::max(t0, t1));
+        if(near <= far){
+            any = true;
+            t_near = std::min(t_near, near);
+        }
+    }
+    return any;
+}
+
+void intersect_sphere_packet(RayPacket& p, float x, float y, float z, float r2, uint32_t index){
+    for(size_t i = 0; i < p.size; i++){
+        float t = intersect_sphere({x - p.ox[i], y - p.oy[i], z - p.oz[i]}, {p.dx[i], p.dy[i], p.dz[i]}, r2);
+        if(t < p.t[i]){
+            p.t[i] = t;
+            p.hit[i] = index;
+        }
+    }
+}
+
+bool cpu_supports_avx(){
+    return false;
+}
+
+static sphere_kernel select_sphere_kernel(){
+    return intersect_spheres_scalar;
+}
+
+#endif
+
+const sphere_kernel intersect_spheres = select_sphere_kernel();
+
+const char* intersect_spheres_name(){
+#ifdef RAYTRACER_X86
+    if(intersect_spheres == intersect_spheres_avx) return "avx";
+    if(intersect_spheres == intersect_spheres_sse) return "sse";
+#endif
+    return "scalar";
+}
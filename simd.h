@@ -0,0 +1,215 @@
+//        __            _      __               __    ____             
+//   ____/ /___ _____  (_)__  / /___ ___  ___  / /_  / / /_  ___  _____
+//  / __  / __ `/ __ \/ / _ \/ / __ `__ \/ _ \/ __ \/ / __ \/ _ \/ ___/
+// / /_/ / /_/ / / / / /  __/ / / / / / /  __/ / / / / /_/ /  __/ /    
+// \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
+//  https://github.com/danielmehlber                                     
+
+#pragma once
+#include "math.h"
+#include <vector>
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * @brief Index of lowest set bit. x must not be 0.
+ */
+inline uint32_t count_trailing_zeros(uint32_t x) noexcept {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return index;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+/**
+ * @brief Amount of set bits.
+ */
+inline uint32_t count_bits(uint32_t x) noexcept {
+#ifdef _MSC_VER
+    return __popcnt(x);
+#else
+    return __builtin_popcount(x);
+#endif
+}
+
+/**
+ * @brief Spheres stored as structure of arrays (center x/y/z and squared radius), as used by SIMD kernels.
+ * Arrays are padded so kernels may read a full vector behind the last sphere.
+ */
+struct SphereSoA {
+    /**
+     * @brief Amount of padding elements behind the last sphere.
+     */
+    static constexpr size_t padding {8};
+    /**
+     * @brief Centers and squared radii. Point into own storage or into external memory (see view()).
+     */
+    const float *x {nullptr}, *y {nullptr}, *z {nullptr}, *r2 {nullptr};
+
+    SphereSoA() = default;
+    SphereSoA(const SphereSoA&) = delete;
+    SphereSoA& operator=(const SphereSoA&) = delete;
+
+    /**
+     * @brief Resize own storage. Spheres never intersect until set (squared radius is NaN).
+     * @param count amount of spheres.
+     */
+    void resize(size_t count);
+    /**
+     * @brief Use external memory instead of own storage (e.g. a mapped cache file). Memory must outlive this object.
+     * @param data block of data() layout for count spheres.
+     * @param count amount of spheres.
+     */
+    void view(const float* data, size_t count);
+    /**
+     * @brief Get all data as one block: x, y, z and r2 after one another, each count + padding floats long.
+     * @return const float* data.
+     */
+    inline const float* data() const noexcept { return x; }
+    /**
+     * @brief Get size of data() in floats.
+     * @return size_t amount of floats.
+     */
+    static inline size_t data_size(size_t count) noexcept { return 4 * (count + padding); }
+    /**
+     * @brief Set sphere at index.
+     * @param index index of sphere.
+     * @param center center of sphere.
+     * @param radius radius of sphere.
+     */
+    void set(size_t index, const Vec3<float>& center, float radius);
+    /**
+     * @brief Get amount of spheres (without padding).
+     * @return size_t amount of spheres.
+     */
+    inline size_t size() const noexcept { return m_count; }
+
+protected:
+    std::vector<float>  m_storage;
+    size_t              m_count {0};
+};
+
+/**
+ * @brief Coherent rays (e.g. primary rays of a pixel block) traced together. Lanes are stored as structure of arrays.
+ */
+struct RayPacket {
+    /**
+     * @brief Max amount of lanes (8x8 pixel block).
+     */
+    static constexpr size_t max_size {64};
+    /**
+     * @brief Amount of lanes in use. Multiple of 4.
+     */
+    size_t size {0};
+    /**
+     * @brief Start points, directions (normalized) and inverse directions of lanes.
+     */
+    alignas(32) float ox[max_size], oy[max_size], oz[max_size];
+    alignas(32) float dx[max_size], dy[max_size], dz[max_size];
+    alignas(32) float ix[max_size], iy[max_size], iz[max_size];
+    /**
+     * @brief Distance of closest intersection per lane. Starts at INFINITY. Inactive lanes use a negative value.
+     */
+    alignas(32) float t[max_size];
+    /**
+     * @brief Index of closest intersected primitive per lane (UINT32_MAX if none).
+     */
+    uint32_t hit[max_size];
+
+    /**
+     * @brief Set lane.
+     * @param lane lane index.
+     * @param start start of ray.
+     * @param dir normalized direction of ray.
+     */
+    void set(size_t lane, const Vec3<float>& start, const Vec3<float>& dir) noexcept;
+    /**
+     * @brief Prepare lane whose start and direction were written directly (e.g. by View::rays()): calculates inverse
+     * direction and resets the closest intersection.
+     * @param lane lane index.
+     */
+    void update(size_t lane) noexcept;
+    /**
+     * @brief Deactivate lane (it will never hit anything).
+     * @param lane lane index.
+     */
+    void disable(size_t lane) noexcept;
+};
+
+/**
+ * @brief Tests all lanes of a packet against a box.
+ * @param packet packet.
+ * @param min corner with smallest coordinates.
+ * @param max corner with largest coordinates.
+ * @param t_near smallest entry distance of all lanes hitting the box.
+ * @return true if any lane enters the box in front of its start and before its closest intersection.
+ */
+bool intersect_box_packet(const RayPacket& packet, const Vec3<float>& min, const Vec3<float>& max, float& t_near);
+/**
+ * @brief Tests all lanes of a packet against a sphere and updates their closest intersections.
+ * @param packet packet.
+ * @param x, y, z, r2 center and squared radius of sphere.
+ * @param index primitive index stored in hitting lanes.
+ */
+void intersect_sphere_packet(RayPacket& packet, float x, float y, float z, float r2, uint32_t index);
+
+/**
+ * @brief Kernel testing one ray against spheres [first, first + count) of SphereSoA. count must not exceed 32.
+ * Per sphere, t is set to the distance of the nearest intersection farther than t_min (INFINITY if none).
+ * Ray direction must be normalized.
+ * @return uint32_t bit i is set if sphere first + i is hit closer than t_max.
+ */
+using sphere_kernel = uint32_t (*)(const SphereSoA& spheres, size_t first, size_t count,
+                                   const Vec3<float>& start, const Vec3<float>& dir, float t_min, float t_max, float* t);
+
+/**
+ * @brief Kernels. Use intersect_spheres, which is the best kernel supported by the CPU. sse tests 4 and avx 8 spheres
+ * per step. avx needs AVX only (no AVX2) and uses no FMA, since fused multiply-adds would round differently from the
+ * scalar kernel, Sphere::intersect and the packet kernels.
+ */
+uint32_t intersect_spheres_scalar(const SphereSoA&, size_t, size_t, const Vec3<float>&, const Vec3<float>&, float, float, float*);
+#ifdef RAYTRACER_X86
+uint32_t intersect_spheres_sse(const SphereSoA&, size_t, size_t, const Vec3<float>&, const Vec3<float>&, float, float, float*);
+uint32_t intersect_spheres_avx(const SphereSoA&, size_t, size_t, const Vec3<float>&, const Vec3<float>&, float, float, float*);
+#endif
+
+/**
+ * @brief Checks if the CPU (and OS) supports AVX.
+ */
+bool cpu_supports_avx();
+
+/**
+ * @brief Kernel selected at startup by CPU features (AVX > SSE > scalar). All kernels round identically, so images do
+ * not depend on the CPU, on the acceleration structure or on packet tracing.
+ */
+extern const sphere_kernel intersect_spheres;
+/**
+ * @brief Get name of selected kernel.
+ * @return const char* "avx", "sse" or "scalar".
+ */
+const char* intersect_spheres_name();
+
+/**
+ * @brief Closed-form ray-sphere intersection. Ray direction must be normalized.
+ * @param oc vector from ray start to sphere center.
+ * @param dir ray direction.
+ * @param r2 squared radius.
+ * @param t_min intersections must be farther than this.
+ * @return float distance of nearest intersection farther than t_min (INFINITY if none).
+ */
+inline float intersect_sphere(const Vec3<float>& oc, const Vec3<float>& dir, float r2, float t_min = 0) noexcept {
+    float b = oc.dot(dir);
+    //r^2 - (distance of center to ray)^2. Computed from the closest point instead of b^2 - (|oc|^2 - r^2),
+    //which cancels catastrophically for small spheres far away from the ray start.
+    Vec3<float> l = oc - dir * b;
+    float disc = r2 - l.dot(l);
+    if(!(disc >= 0)) return INFINITY;
+    float root = std::sqrt(disc);
+    float t0 = b - root, t1 = b + root;
+    return t0 > t_min ? t0 : (t1 > t_min ? t1 : INFINITY);
+}
@@ -6,18 +6,132 @@
 //  https://github.com/danielmehlber                                     
 
 #include "timing.h"
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <memory>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
 Clock::Clock() {
     start();
 }
 
+Clock::Clock(bool running) {
+    if(running) start();
+}
+
 double Clock::start() {
-    last_start = std::chrono::system_clock::now();
-    return last_start.time_since_epoch().count();
+    last_start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(last_start.time_since_epoch()).count();
 }
 
 double Clock::stop() {
-    last_stop = std::chrono::system_clock::now();
-    auto delta = last_stop.time_since_epoch().count() - last_start.time_since_epoch().count();
-    return delta;
-}
\ No newline at end of file
+    last_stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(last_stop - last_start).count();
+}
+
+double Clock::elapsed() const {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - last_start).count();
+}
+
+uint64_t cycle_count() noexcept {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+std::atomic<bool> Profiler::is_enabled {false};
+
+/**
+ * @brief Zones recorded by one thread. Kept alive by the registry after the thread exits.
+ */
+struct ThreadTrace {
+    std::mutex                  mutex;
+    std::vector<Profiler::Event> events;
+    size_t                      thread_id;
+};
+
+/**
+ * @brief Buffers of all threads that recorded zones.
+ */
+struct TraceRegistry {
+    std::mutex                                  mutex;
+    std::vector<std::shared_ptr<ThreadTrace>>   traces;
+    const std::chrono::steady_clock::time_point epoch {std::chrono::steady_clock::now()};
+
+    static TraceRegistry& get(){
+        static TraceRegistry registry;
+        return registry;
+    }
+};
+
+static ThreadTrace& thread_trace(){
+    thread_local std::shared_ptr<ThreadTrace> trace = [](){
+        auto created = std::make_shared<ThreadTrace>();
+        TraceRegistry& registry = TraceRegistry::get();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        created->thread_id = registry.traces.size();
+        registry.traces.push_back(created);
+        return created;
+    }();
+    return *trace;
+}
+
+void Profiler::enable(bool enabled) noexcept {
+    //Start clock of profiler.
+    TraceRegistry::get();
+    is_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t Profiler::now() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - TraceRegistry::get().epoch).count();
+}
+
+void Profiler::record(const Event& event){
+    ThreadTrace& trace = thread_trace();
+    //Only contended while a trace is being written.
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    trace.events.push_back(event);
+}
+
+void Profiler::clear(){
+    TraceRegistry& registry = TraceRegistry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for(auto& trace : registry.traces){
+        std::lock_guard<std::mutex> trace_lock(trace->mutex);
+        trace->events.clear();
+    }
+}
+
+void Profiler::write_chrome_trace(const char* path){
+    FILE* file = std::fopen(path, "wb");
+    if(!file) throw "Cannot open trace file.";
+    TraceRegistry& registry = TraceRegistry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    std::fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    bool first = true;
+    for(auto& trace : registry.traces){
+        std::lock_guard<std::mutex> trace_lock(trace->mutex);
+        if(trace->events.empty()) continue;
+        //Name thread rows in viewer.
+        std::fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"thread %zu\"}}",
+                     first ? "" : ",", trace->thread_id, trace->thread_id);
+        first = false;
+        for(const Event& event : trace->events){
+            std::fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f",
+                         event.name, event.category, trace->thread_id, event.start / 1000.0, event.duration / 1000.0);
+            if(event.arg >= 0) std::fprintf(file, ", \"args\": {\"index\": %lld}", (long long)event.arg);
+            std::fprintf(file, "}");
+        }
+    }
+    std::fprintf(file, "\n]}\n");
+    if(std::fclose(file) != 0) throw "Cannot write trace file.";
+}
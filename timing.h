@@ -5,22 +5,31 @@
 // \__,_/\__,_/_/ /_/_/\___/_/_/ /_/ /_/\___/_/ /_/_/_.___/\___/_/     
 //  https://github.com/danielmehlber                                     
 
+#pragma once
 #include <chrono>
+#include <atomic>
+#include <cstdint>
 
 /**
- * @brief Measures time. Used for render time.
+ * @brief Measures time on a monotonic clock. Used for render time.
  */
 class Clock {
 public:
-    std::chrono::system_clock::time_point last_start;
-    std::chrono::system_clock::time_point last_stop;
+    std::chrono::steady_clock::time_point last_start;
+    std::chrono::steady_clock::time_point last_stop;
     /**
      * @brief Construct a new Clock object and starts time measurement.
      */
     Clock();
+    /**
+     * @brief Construct a new Clock object.
+     * @param running if true, time measurement is started. Otherwise the clock is not read (e.g. in hot paths
+     * which only measure while statistics are collected).
+     */
+    explicit Clock(bool running);
     /**
      * @brief Starts time measurement.
-     * @return double time of starting measurement.
+     * @return double time of starting measurement (in nano-seconds, arbitrary epoch).
      */
     double start();
     /**
@@ -28,4 +37,101 @@ public:
      * @return double measured time in nano-seconds.
      */
     double stop();
-};
\ No newline at end of file
+    /**
+     * @brief Time since start without stopping (safe to call from several threads).
+     * @return double elapsed time in nano-seconds.
+     */
+    double elapsed() const;
+};
+
+/**
+ * @brief Read a fine-grained cycle counter: time stamp counter on x86, nano-seconds of a monotonic clock otherwise.
+ * Only differences of values read on the same thread are meaningful.
+ * @return uint64_t counter value.
+ */
+uint64_t cycle_count() noexcept;
+
+/**
+ * @brief Records profiling zones of all threads and exports them as Chrome trace events (chrome://tracing, Perfetto).
+ * Disabled by default: zones cost a single relaxed load then.
+ */
+class Profiler {
+public:
+    /**
+     * @brief Finished zone.
+     */
+    struct Event {
+        const char* name;
+        const char* category;
+        /**
+         * @brief Optional argument (e.g. tile index). Negative = none.
+         */
+        int64_t     arg;
+        /**
+         * @brief Start (since first use of profiler) and duration in nano-seconds.
+         */
+        uint64_t    start, duration;
+    };
+
+    /**
+     * @brief Enable or disable recording of zones.
+     * @param enabled true = record.
+     */
+    static void enable(bool enabled = true) noexcept;
+    /**
+     * @brief Checks if zones are recorded.
+     */
+    static inline bool enabled() noexcept { return is_enabled.load(std::memory_order_relaxed); }
+    /**
+     * @brief Get current time of profiler clock.
+     * @return uint64_t nano-seconds since first use of profiler.
+     */
+    static uint64_t now() noexcept;
+    /**
+     * @brief Store finished zone in buffer of calling thread.
+     * @param event zone.
+     */
+    static void record(const Event& event);
+    /**
+     * @brief Discard all recorded zones.
+     */
+    static void clear();
+    /**
+     * @brief Write recorded zones of all threads as Chrome trace event JSON. Zones still open are not included.
+     * @param path file path (file will be created or overwritten).
+     */
+    static void write_chrome_trace(const char* path);
+
+protected:
+    static std::atomic<bool> is_enabled;
+};
+
+/**
+ * @brief Profiling zone: Records the time from construction to destruction, if the profiler is enabled.
+ * Name and category must be string literals (or outlive the profiler).
+ */
+class ProfileZone {
+protected:
+    const char* m_name;
+    const char* m_category;
+    int64_t     m_arg;
+    uint64_t    m_start {0};
+    bool        m_active;
+public:
+    /**
+     * @brief Open zone.
+     * @param name name of zone.
+     * @param category category of zone.
+     * @param arg optional argument (e.g. tile index). Negative = none.
+     */
+    inline ProfileZone(const char* name, const char* category = "render", int64_t arg = -1) noexcept
+    : m_name{name}, m_category{category}, m_arg{arg}, m_active{Profiler::enabled()}
+    {
+        if(m_active) m_start = Profiler::now();
+    }
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+    inline ~ProfileZone(){
+        if(m_active) Profiler::record({m_name, m_category, m_arg, m_start, Profiler::now() - m_start});
+    }
+};